@@ -0,0 +1,101 @@
+#include <string.h>
+
+#include "arena.h"
+#include "common.h"
+#include "memory.h"
+
+#define ARENA_ALIGN 8
+#define ARENA_MIN_BLOCK (4 * 1024)
+#define ARENA_MAX_BLOCK (1024 * 1024)
+
+#define ALIGN_UP(size) (((size) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+void initArena(Arena* arena)
+{
+    arena->blocks = NULL;
+    arena->last = NULL;
+}
+
+/*
+ * Starts a block with room for at least 'size' bytes. Blocks double in
+ * size, up to ARENA_MAX_BLOCK unless one allocation needs more.
+ */
+static void newBlock(Arena* arena, size_t size)
+{
+    size_t blockSize = arena->blocks != NULL ? arena->blocks->size * 2 : ARENA_MIN_BLOCK;
+    if (blockSize > ARENA_MAX_BLOCK) blockSize = ARENA_MAX_BLOCK;
+    if (blockSize < size) blockSize = size;
+
+    ArenaBlock* block = (ArenaBlock*)reallocate(NULL, 0, sizeof(ArenaBlock) + blockSize);
+    block->next = arena->blocks;
+    block->size = blockSize;
+    block->used = 0;
+    arena->blocks = block;
+}
+
+/*
+ * Like reallocate(), for an array on 'arena': returns 'pointer' resized
+ * from 'oldSize' to 'newSize' bytes, which is NULL and 0 for a new one.
+ * Nothing is ever freed before freeArena().
+ */
+void* arenaGrow(Arena* arena, void* pointer, size_t oldSize, size_t newSize)
+{
+    ArenaBlock* block = arena->blocks;
+    if (pointer != NULL && pointer == arena->last)
+    {
+        size_t start = (size_t)((uint8_t*)pointer - block->data);
+        if (start + ALIGN_UP(newSize) <= block->size)
+        {
+            block->used = start + ALIGN_UP(newSize);
+            return pointer;
+        }
+    }
+
+    size_t size = ALIGN_UP(newSize);
+    if (block == NULL || block->used + size > block->size)
+    {
+        newBlock(arena, size);
+        block = arena->blocks;
+    }
+
+    void* result = block->data + block->used;
+    block->used += size;
+    if (oldSize > 0) memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+    arena->last = result;
+    return result;
+}
+
+ArenaMark arenaMark(Arena* arena)
+{
+    ArenaMark mark;
+    mark.block = arena->blocks;
+    mark.used = arena->blocks != NULL ? arena->blocks->used : 0;
+    return mark;
+}
+
+/*
+ * Frees everything allocated since 'mark' was taken.
+ */
+void arenaRelease(Arena* arena, ArenaMark mark)
+{
+    while (arena->blocks != mark.block)
+    {
+        ArenaBlock* block = arena->blocks;
+        arena->blocks = block->next;
+        reallocate(block, sizeof(ArenaBlock) + block->size, 0);
+    }
+    if (mark.block != NULL) mark.block->used = mark.used;
+    arena->last = NULL;
+}
+
+void freeArena(Arena* arena)
+{
+    ArenaBlock* block = arena->blocks;
+    while (block != NULL)
+    {
+        ArenaBlock* next = block->next;
+        reallocate(block, sizeof(ArenaBlock) + block->size, 0);
+        block = next;
+    }
+    initArena(arena);
+}
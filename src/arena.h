@@ -0,0 +1,37 @@
+#ifndef clox_arena_h
+#define clox_arena_h
+
+#include "common.h"
+
+// Memory for the arrays a compile keeps growing (see chunk.c). It's handed
+// out by bumping a pointer through blocks and freed all at once, or back to
+// a mark taken earlier, so a grown array leaves its old copy behind until
+// then. Growing what was allocated last takes no copy, as long as the
+// block has room.
+typedef struct ArenaBlock
+{
+	struct ArenaBlock* next;		// Block allocated before this one
+	size_t size;					// Bytes in data
+	size_t used;
+	uint8_t data[];
+} ArenaBlock;
+
+typedef struct Arena
+{
+	ArenaBlock* blocks;				// Newest first
+	void* last;						// What was allocated last, NULL if nothing yet
+} Arena;
+
+typedef struct
+{
+	ArenaBlock* block;				// Newest block when the mark was taken
+	size_t used;					// Its 'used' then
+} ArenaMark;
+
+void initArena(Arena* arena);
+void* arenaGrow(Arena* arena, void* pointer, size_t oldSize, size_t newSize);
+ArenaMark arenaMark(Arena* arena);
+void arenaRelease(Arena* arena, ArenaMark mark);
+void freeArena(Arena* arena);
+
+#endif
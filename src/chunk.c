@@ -1,5 +1,7 @@
 #include <stdlib.h>
+#include <string.h>
 
+#include "arena.h"
 #include "chunk.h"
 #include "memory.h"
 #include "value.h"
@@ -10,8 +12,32 @@ void initChunk(Chunk* chunk)
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
+    chunk->arena = NULL;
+}
+
+/*
+ * Grows an array of 'chunk', on its arena while it's being compiled.
+ */
+static void* growArray(Chunk* chunk, void* pointer, size_t oldSize, size_t newSize)
+{
+    if (chunk->arena != NULL) return arenaGrow(chunk->arena, pointer, oldSize, newSize);
+    return reallocate(pointer, oldSize, newSize);
+}
+
+/*
+ * Copies an array off the arena at its final size.
+ */
+static void* copyOut(const void* pointer, size_t size)
+{
+    if (size == 0) return NULL;
+
+    void* copy = reallocate(NULL, 0, size);
+    memcpy(copy, pointer, size);
+    return copy;
 }
 
 void writeChunk(Chunk* chunk, uint8_t byte, int srcCodeLineNr)
@@ -20,29 +46,102 @@ void writeChunk(Chunk* chunk, uint8_t byte, int srcCodeLineNr)
     {
         int oldCapacity = chunk->capacity;
         chunk->capacity = NEW_ARRAY_CAPACITY(oldCapacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
+        chunk->code = (uint8_t*)growArray(chunk, chunk->code, oldCapacity, chunk->capacity);
     }
 
     // arrays are obv zero-indexed so count points to first free slot
     chunk->code[chunk->count] = byte; 
-    chunk->lines[chunk->count] = srcCodeLineNr;
+
+    // The compiler sometimes truncates the code it just wrote, so drop
+    // any runs that start past the new end before extending the last one.
+    while (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].offset >= chunk->count)
+    {
+        chunk->lineCount--;
+    }
+
+    if (chunk->lineCount == 0 || chunk->lines[chunk->lineCount - 1].line != srcCodeLineNr)
+    {
+        if (chunk->lineCapacity < chunk->lineCount + 1)
+        {
+            int oldCapacity = chunk->lineCapacity;
+            chunk->lineCapacity = NEW_ARRAY_CAPACITY(oldCapacity);
+            chunk->lines = (LineStart*)growArray(chunk, chunk->lines,
+                sizeof(LineStart) * oldCapacity, sizeof(LineStart) * chunk->lineCapacity);
+        }
+
+        LineStart* start = &chunk->lines[chunk->lineCount++];
+        start->offset = chunk->count;
+        start->line = srcCodeLineNr;
+    }
+
     chunk->count++;
 }
 
+/*
+ * Once nothing more will be written to the chunk, moves its arrays off
+ * the arena into memory of their own, without the slack left over from
+ * growing.
+ */
+void finishChunk(Chunk* chunk)
+{
+    if (chunk->arena == NULL) return;
+
+    chunk->code = (uint8_t*)copyOut(chunk->code, chunk->count);
+    chunk->capacity = chunk->count;
+    chunk->lines = (LineStart*)copyOut(chunk->lines, sizeof(LineStart) * chunk->lineCount);
+    chunk->lineCapacity = chunk->lineCount;
+
+    ValueArray* constants = &chunk->constants;
+    constants->values = (Value*)copyOut(constants->values, sizeof(Value) * constants->count);
+    constants->capacity = constants->count;
+    chunk->arena = NULL;
+}
+
 void freeChunk(Chunk* chunk)
 {
-    FREE_ARRAY(size_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
-    freeValueArray(&chunk->constants);
+    // Chunks loaded from an image don't own their code and lines, and
+    // ones still being compiled own nothing but the arena does.
+    if (chunk->arena == NULL)
+    {
+        if (chunk->capacity > 0) FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+        if (chunk->lineCapacity > 0) FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+        freeValueArray(&chunk->constants);
+    }
     initChunk(chunk);
 }
 
+/*
+ * Appends 'value' to the constants of 'chunk' and returns its index. The
+ * caller keeps 'value' reachable, in case growing the array collects.
+ */
 int addConstant(Chunk* chunk, Value value)
 {
-    pushValue(value); 
-    writeValueArray(&chunk->constants, value);
-    popValue();
-    // return array index of the stored value
-    return chunk->constants.count - 1;
+    ValueArray* constants = &chunk->constants;
+    if (constants->capacity < constants->count + 1)
+    {
+        int oldCapacity = constants->capacity;
+        constants->capacity = NEW_ARRAY_CAPACITY(oldCapacity);
+        constants->values = (Value*)growArray(chunk, constants->values,
+            sizeof(Value) * oldCapacity, sizeof(Value) * constants->capacity);
+    }
+
+    constants->values[constants->count] = value;
+    return constants->count++;
+}
+
+/*
+ * Finds the source line of the byte at 'offset' by binary searching for
+ * the last run that starts at or before it.
+ */
+int getLine(Chunk* chunk, int offset)
+{
+    int low = 0;
+    int high = chunk->lineCount - 1;
+    while (low < high)
+    {
+        int middle = low + (high - low + 1) / 2;
+        if (chunk->lines[middle].offset <= offset) low = middle;
+        else high = middle - 1;
+    }
+    return chunk->lineCount > 0 ? chunk->lines[low].line : 0;
 }
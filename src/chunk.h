@@ -4,31 +4,56 @@
 #include "common.h"
 #include "value.h"
 
+// Compiled chunks get cached on disk (see image.c), so changing what an
+// opcode means or renumbering them requires bumping IMAGE_VERSION.
+// The _LONG forms take a 24-bit constant index, a 16-bit local slot or a
+// 32-bit jump offset; the compiler only emits them when the short operand
+// doesn't fit.
 typedef enum
 {
 	OP_ADD,			// 0
 	OP_CALL,
 	OP_CLASS,
+	OP_CLASS_LONG,
 	OP_CLOSE_UPVALUE,
 	OP_CLOSURE,
+	OP_CLOSURE_LONG,
 	OP_CONSTANT,
+	OP_CONSTANT_LONG,
 	OP_DEFINE_GLOBAL,
+	OP_DEFINE_GLOBAL_LONG,
 	OP_DIVIDE,
 	OP_EQUAL,
 	OP_FALSE,
 	OP_GET_GLOBAL,
+	OP_GET_GLOBAL_LONG,
 	OP_GET_LOCAL,
+	OP_GET_LOCAL_LONG,
 	OP_GET_PROPERTY,
+	OP_GET_PROPERTY_LONG,
 	OP_GET_SUPER,
+	OP_GET_SUPER_LONG,
 	OP_GET_UPVALUE,
 	OP_GREATER,
+	OP_IMPORT,
+	OP_IMPORT_LONG,
 	OP_INHERIT,
 	OP_INVOKE,
+	OP_INVOKE_LONG,
 	OP_JUMP,
+	OP_JUMP_LONG,
+	OP_JUMP_IF_EQUAL,
 	OP_JUMP_IF_FALSE,
+	OP_JUMP_IF_GREATER,
+	OP_JUMP_IF_LESS,
+	OP_JUMP_IF_NOT_EQUAL,
+	OP_JUMP_IF_NOT_GREATER,
+	OP_JUMP_IF_NOT_LESS,
 	OP_LESS,
 	OP_LOOP,
+	OP_LOOP_LONG,
 	OP_METHOD,
+	OP_METHOD_LONG,
 	OP_MULTIPLY,
 	OP_NEGATE,
 	OP_NOT,
@@ -37,27 +62,42 @@ typedef enum
 	OP_PRINT,
 	OP_RETURN,
 	OP_SET_GLOBAL,
+	OP_SET_GLOBAL_LONG,
 	OP_SET_LOCAL,
+	OP_SET_LOCAL_LONG,
 	OP_SET_PROPERTY,
+	OP_SET_PROPERTY_LONG,
 	OP_SET_UPVALUE,
 	OP_SUBTRACT,
 	OP_SUPER_INVOKE,
+	OP_SUPER_INVOKE_LONG,
 	OP_TRUE,
 } OpCode;
 
+// A run of bytecode that all came from the same source line.
+typedef struct
+{
+	int offset;				// offset of the first byte in the run
+	int line;				// source code line nr
+} LineStart;
+
 typedef struct 
 {
 	int count;				// nr of opcodes currently stored in array
-	int capacity;			// capacity of array
+	int capacity;			// capacity of array (0 if code is borrowed from an image)
 	uint8_t* code;			// an array of OpCodes and operands (operands are indexes into Chunk.constants)
-	int* lines;				// source code line nrs (indexes follow code array)
-	// TODO: challenge: make lines more memory efficient (c.f. challenge ch 14)
+	int lineCount;			// nr of runs in lines
+	int lineCapacity;		// capacity of lines (0 if borrowed from an image)
+	LineStart* lines;		// source code line nrs, one entry per run of bytes (ordered by offset)
 	ValueArray constants;	// constants used by opcodes in chunk
+	struct Arena* arena;	// where the arrays grow while being compiled, NULL once finished
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int srcCodeLineNr);
+void finishChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 int addConstant(Chunk* chunk, Value value);
+int getLine(Chunk* chunk, int offset);
 
 #endif
@@ -9,5 +9,7 @@
 //#define DEBUG_STRESS_GC
 //#define DEBUG_LOG_GC
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
+#define UINT24_MAX 0xffffff
 
 #endif
@@ -3,25 +3,28 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
 #include "chunk.h"
 #include "common.h"
 #include "compiler.h"
 #include "memory.h"
 #include "object.h"
 #include "scanner.h"
+#include "table.h"
 #include "value.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
-typedef struct
-{
-    Token current;      // Token being parsed
-    Token previous;     // Last token parsed
-    bool hadError;
-    bool panicMode;
-} Parser;
+// Forward jumps get routed through an island once the code they jump over
+// is within this many bytes of what a 16-bit operand can reach. Anything
+// between two declarations has to fit in it.
+#define JUMP_ISLAND_MARGIN 8192
+
+typedef struct Parser Parser;
+
 
 typedef enum 
 {
@@ -38,7 +41,7 @@ typedef enum
     PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)(bool canAssign);
+typedef void (*ParseFn)(Parser* parser, bool canAssign);
 
 typedef struct 
 {
@@ -56,10 +59,33 @@ typedef struct
 
 typedef struct
 {
-    uint8_t index;
+    uint16_t index;
     bool isLocal;
 } Upvalue;
 
+// A forward jump whose target isn't known yet. Its operand moves when the
+// jump gets routed through an island (see emitJumpIsland()).
+typedef struct
+{
+    int offset;                 // Offset of the operand, -1 once patched
+    bool isLong;                // Whether the operand is 32 bits
+} PendingJump;
+
+// Where each constant already in the chunk being compiled is, so a value
+// used more than once takes a single slot.
+typedef struct
+{
+    Value value;
+    int index;                  // Index in the constant pool, -1 if the slot is empty
+} ConstantSlot;
+
+typedef struct
+{
+    int count;
+    int capacity;
+    ConstantSlot* slots;
+} ConstantIndex;
+
 typedef enum
 {
     TYPE_FUNCTION,
@@ -73,10 +99,20 @@ typedef struct Compiler
     struct Compiler* enclosing;
     ObjFunction* function;
     FunctionType functionType;
-    Local locals[UINT8_COUNT];
+    Local* locals;
     int localCount;
+    int localCapacity;
     Upvalue upvalues[UINT8_COUNT];
     int scopeDepth;
+    int comparisonStart;        // Offset of the last comparison emitted
+    int comparisonEnd;          // Offset just past it, -1 if it can't be fused
+    uint8_t comparisonJump;     // Fused jump taken when that comparison is false
+    Token* capturedNames;       // Names of upvalues resolved before compiling (lazy bodies)
+    ConstantIndex constants;
+    PendingJump* jumps;         // Indexed by what emitJump() returned
+    int jumpCount;
+    int jumpCapacity;
+    ArenaMark arenaMark;        // Where the function's chunk starts on the parser's arena
 } Compiler;
 
 typedef struct ClassCompiler
@@ -85,25 +121,56 @@ typedef struct ClassCompiler
     bool hasSuperClass;
 } ClassCompiler;
 
-static void expression();
-static void statement();
-static void declaration();
-static ParseRule* getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
+// Everything a single compile works on. Nothing in here is shared, so
+// separate files can be compiled on separate threads at once.
+struct Parser
+{
+    Scanner scanner;
+    Token current;                  // Token being parsed
+    Token previous;                 // Last token parsed
+    bool hadError;
+    bool panicMode;
+    const char* path;               // Path of the file being compiled, NULL for the repl
+    Compiler* compiler;             // Innermost function being compiled
+    ClassCompiler* currentClass;    // Innermost class being compiled
+    Arena arena;                    // Where the chunks grow until each function is done
+    bool gcWasPaused;               // vm.gcPaused before the compile paused it
+};
 
-static Parser parser; // TODO: global no good
-Compiler* current = NULL;
-ClassCompiler* currentClass = NULL;
+// In lazy mode function() only records where a body starts and which
+// enclosing variables it captures. The body gets compiled from the source
+// on the function's first call, so the source must outlive the function.
+typedef struct LazyBody
+{
+    const char* source;         // '(' that starts the parameter list
+    int line;                   // Source code line nr of that '('
+    FunctionType functionType;
+    bool inClass;               // Whether 'this' is allowed in the body
+    bool hasSuperClass;         // Whether 'super' is allowed in the body
+    const char* path;           // Path of the file the body is in
+    Token* upvalueNames;        // Name of each captured variable, by upvalue index
+} LazyBody;
+
+static void expression(Parser* parser);
+static void statement(Parser* parser);
+static void declaration(Parser* parser);
+static ParseRule* getRule(TokenType type);
+static void parsePrecedence(Parser* parser, Precedence precedence);
 
-static Chunk* currentChunk()
+static Chunk* currentChunk(Parser* parser)
 {
-    return &current->function->chunk;
+    return &parser->compiler->function->chunk;
 }
 
-static void errorAt(Token* token, const char* message)
+static void errorAt(Parser* parser, Token* token, const char* message)
 {
-    if (parser.panicMode) return;
-    parser.panicMode = true;
+    if (parser->panicMode) return;
+    parser->panicMode = true;
+    parser->hadError = true;
+
+    // A file compiled ahead of time on another thread gets compiled again
+    // when it's imported, which is when its errors get reported.
+    if (localHeap != NULL) return;
 
     fprintf(stderr, "[line %d] Error", token->src_code_line);
     
@@ -121,17 +188,16 @@ static void errorAt(Token* token, const char* message)
     }
 
     fprintf(stderr, ": %s\n", message);
-    parser.hadError = true;
 }
 
-static void error(const char* message)
+static void error(Parser* parser, const char* message)
 {
-    errorAt(&parser.previous, message);
+    errorAt(parser, &parser->previous, message);
 }
 
-static void errorAtCurrent(const char* message)
+static void errorAtCurrent(Parser* parser, const char* message)
 {
-    errorAt(&parser.current, message);
+    errorAt(parser, &parser->current, message);
 }
 
 // const char* TokenTypeStrings[] = { // for debugging purposes
@@ -145,140 +211,377 @@ static void errorAtCurrent(const char* message)
 //   "TOKEN_LESS","TOKEN_LESS_EQUAL",
 //   "TOKEN_IDENTIFIER","TOKEN_STRING", "TOKEN_NUMBER",
 //   "TOKEN_AND","TOKEN_CLASS", "TOKEN_ELSE", "TOKEN_FALSE",
-//   "TOKEN_FOR","TOKEN_FUN", "TOKEN_IF", "TOKEN_NIL", "TOKEN_OR",
+//   "TOKEN_FOR","TOKEN_FUN", "TOKEN_IF", "TOKEN_IMPORT", "TOKEN_NIL", "TOKEN_OR",
 //   "TOKEN_PRINT","TOKEN_RETURN", "TOKEN_SUPER", "TOKEN_THIS",
 //   "TOKEN_TRUE","TOKEN_VAR", "TOKEN_WHILE",
 //   "TOKEN_ERROR","TOKEN_EOF",
 // };
 
 
-static void advance()
+static void advance(Parser* parser)
 {
-    parser.previous = parser.current;
+    parser->previous = parser->current;
     
     while(1)
     {
-        parser.current = scanToken();
-        if (parser.current.type != TOKEN_ERROR) break;
+        parser->current = scanToken(&parser->scanner);
+        if (parser->current.type != TOKEN_ERROR) break;
         // below is bit confusing because 'lexeme_start' for an 
         // error token just points to a string literal in static 
         // memory. It is null-teriminated. It doesn't point 
         // to the source code like this member var usually does.
-        errorAtCurrent(parser.current.lexeme_start); 
+        errorAtCurrent(parser, parser->current.lexeme_start); 
     }
 }
 
-static void consume(TokenType type, const char* message)
+static void consume(Parser* parser, TokenType type, const char* message)
 {
-    if (parser.current.type == type)
+    if (parser->current.type == type)
     {
-        advance();
+        advance(parser);
         return;
     }
-    errorAtCurrent(message);
+    errorAtCurrent(parser, message);
 }
 
-static bool check(TokenType type)
+static bool check(Parser* parser, TokenType type)
 {
-    return parser.current.type == type;
+    return parser->current.type == type;
 }
 
-static bool match(TokenType type)
+static bool match(Parser* parser, TokenType type)
 {
-    if (!check(type)) return false;
-    advance();
+    if (!check(parser, type)) return false;
+    advance(parser);
     return true;
 }
 
-static void emitByte(uint8_t byte)
+static void emitByte(Parser* parser, uint8_t byte)
 {
-    writeChunk(currentChunk(), byte, parser.previous.src_code_line);
+    writeChunk(currentChunk(parser), byte, parser->previous.src_code_line);
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2)
+static void emitBytes(Parser* parser, uint8_t byte1, uint8_t byte2)
 {
     // TODO make generic? Like argc & argv?
     // so we don't need two functions (emitByte & emitBytes)
-    emitByte(byte1);
-    emitByte(byte2);
+    emitByte(parser, byte1);
+    emitByte(parser, byte2);
+}
+
+static void emitUint16(Parser* parser, int value)
+{
+    emitByte(parser, (value >> 8) & 0xff);
+    emitByte(parser, value & 0xff);
+}
+
+static void emitUint24(Parser* parser, int value)
+{
+    emitByte(parser, (value >> 16) & 0xff);
+    emitUint16(parser, value);
+}
+
+static void emitUint32(Parser* parser, uint32_t value)
+{
+    emitByte(parser, (value >> 24) & 0xff);
+    emitUint24(parser, (int)(value & 0xffffff));
+}
+
+/*
+ * Emits an instruction that takes a constant index, or its _LONG form if
+ * the index doesn't fit in a byte.
+ */
+static void emitConstantOp(Parser* parser, uint8_t instruction, uint8_t longInstruction, int constant)
+{
+    if (constant <= UINT8_MAX)
+    {
+        emitBytes(parser, instruction, (uint8_t)constant);
+        return;
+    }
+    emitByte(parser, longInstruction);
+    emitUint24(parser, constant);
+}
+
+static void emitLoop(Parser* parser, int loopStart)
+{
+    // + 3 to also jump back over the OP_LOOP and its operand
+    int offset = currentChunk(parser)->count - loopStart + 3;
+    if (offset <= UINT16_MAX)
+    {
+        emitByte(parser, OP_LOOP);
+        emitUint16(parser, offset);
+        return;
+    }
+
+    emitByte(parser, OP_LOOP_LONG);
+    emitUint32(parser, (uint32_t)offset + 2);
 }
 
-static void emitLoop(int loopStart)
+/*
+ * Emits a forward jump with a 16-bit placeholder operand and returns the
+ * handle to pass to patchJump() once the target is known.
+ */
+static int emitJump(Parser* parser, uint8_t instruction)
 {
-    emitByte(OP_LOOP);
+    Compiler* compiler = parser->compiler;
+    if (compiler->jumpCapacity < compiler->jumpCount + 1)
+    {
+        int oldCapacity = compiler->jumpCapacity;
+        compiler->jumpCapacity = NEW_ARRAY_CAPACITY(oldCapacity);
+        compiler->jumps = GROW_ARRAY(PendingJump, compiler->jumps, oldCapacity, compiler->jumpCapacity);
+    }
 
-    int offset = currentChunk()->count - loopStart + 2;
-    if (offset > UINT16_MAX) error("Loop body too large");
+    emitByte(parser, instruction);
+    emitUint16(parser, 0xffff);
 
-    emitByte((offset >> 8) & 0xff);
-    emitByte(offset & 0xff);
+    PendingJump* jump = &compiler->jumps[compiler->jumpCount];
+    jump->offset = currentChunk(parser)->count - 2;
+    jump->isLong = false;
+    return compiler->jumpCount++;
 }
 
-static int emitJump(uint8_t instruction)
+/*
+ * Points a pending jump at the end of the code emitted so far.
+ */
+static void targetJump(Parser* parser, PendingJump* jump)
 {
-    emitByte(instruction);
-    emitByte(0xff);
-    emitByte(0xff);
-    return currentChunk()->count -2;
+    uint8_t* operand = currentChunk(parser)->code + jump->offset;
+    if (jump->isLong)
+    {
+        // -4 to adjust for the bytecode for the jump offset itself
+        uint32_t distance = (uint32_t)(currentChunk(parser)->count - jump->offset - 4);
+        operand[0] = (distance >> 24) & 0xff;
+        operand[1] = (distance >> 16) & 0xff;
+        operand[2] = (distance >> 8) & 0xff;
+        operand[3] = distance & 0xff;
+        return;
+    }
+
+    // -2 to adjust for the bytecode for the jump offset itself
+    int distance = currentChunk(parser)->count - jump->offset - 2;
+    if (distance > UINT16_MAX) error(parser, "Too much code to jump over.");
+
+    operand[0] = (distance >> 8) & 0xff;  // get top 8 bits of 'distance'
+    operand[1] = distance & 0xff;         // and bottom 8 bits
 }
 
-static void emitReturn()
+/*
+ * Forward jumps only get 16 bits, since they're emitted before anyone
+ * knows how far they go. Once the code they jump over nears that limit,
+ * every pending jump is routed through an island of OP_JUMP_LONGs right
+ * here, which normal execution skips.
+ */
+static void emitJumpIsland(Parser* parser)
 {
-    if (current->functionType == TYPE_INITIALIZER)
+    Compiler* compiler = parser->compiler;
+    int oldest = -1;
+    for (int i = 0; i < compiler->jumpCount; i++)
     {
-        emitBytes(OP_GET_LOCAL, 0);
+        PendingJump* jump = &compiler->jumps[i];
+        if (jump->offset != -1 && !jump->isLong && (oldest == -1 || jump->offset < oldest))
+        {
+            oldest = jump->offset;
+        }
+    }
+    if (oldest == -1 || currentChunk(parser)->count - oldest < UINT16_MAX - JUMP_ISLAND_MARGIN) return;
+
+    emitByte(parser, OP_JUMP);
+    PendingJump skip = {currentChunk(parser)->count, false};
+    emitUint16(parser, 0xffff);
+
+    for (int i = 0; i < compiler->jumpCount; i++)
+    {
+        PendingJump* jump = &compiler->jumps[i];
+        if (jump->offset == -1 || jump->isLong) continue;
+
+        targetJump(parser, jump);
+        emitByte(parser, OP_JUMP_LONG);
+        jump->offset = currentChunk(parser)->count;
+        jump->isLong = true;
+        emitUint32(parser, 0xffffffff);
+    }
+
+    targetJump(parser, &skip);
+}
+
+static void emitReturn(Parser* parser)
+{
+    if (parser->compiler->functionType == TYPE_INITIALIZER)
+    {
+        emitBytes(parser, OP_GET_LOCAL, 0);
     } 
     else
     {
-        emitByte(OP_NIL);
+        emitByte(parser, OP_NIL);
+    }
+    emitByte(parser, OP_RETURN);
+}
+
+static uint32_t hashConstant(Value value)
+{
+    uint64_t bits;
+    switch (value.type)
+    {
+        case VAL_BOOL: return AS_BOOL(value) ? 1 : 2;
+        case VAL_NIL: return 3;
+        case VAL_NUMBER:
+            memcpy(&bits, &AS_NUMBER(value), sizeof(bits));
+            break;
+        case VAL_OBJ:
+            if (IS_STRING(value)) return AS_STRING(value)->hash;
+            bits = (uintptr_t)AS_OBJ(value) >> 3;
+            break;
+        default:
+            return 0;
+    }
+    bits *= 0x9e3779b97f4a7c15u;
+    return (uint32_t)(bits >> 32);
+}
+
+/*
+ * Stricter than valuesEqual(): numbers have to be the same bits, so 0 and
+ * -0 keep a constant each. Strings are interned and compare by address.
+ */
+static bool sameConstant(Value a, Value b)
+{
+    if (a.type != b.type) return false;
+    if (IS_NUMBER(a)) return memcmp(&AS_NUMBER(a), &AS_NUMBER(b), sizeof(double)) == 0;
+    if (IS_OBJ(a)) return AS_OBJ(a) == AS_OBJ(b);
+    return valuesEqual(a, b);
+}
+
+static ConstantSlot* findConstantSlot(ConstantSlot* slots, int capacity, Value value)
+{
+    uint32_t index = hashConstant(value) & (capacity - 1);
+    while (slots[index].index != -1 && !sameConstant(slots[index].value, value))
+    {
+        index = (index + 1) & (capacity - 1);
     }
-    emitByte(OP_RETURN);
+    return &slots[index];
 }
 
-static uint8_t makeConstant(Value value)
+static void growConstantIndex(ConstantIndex* constants)
 {
-    int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX)
+    int capacity = NEW_ARRAY_CAPACITY(constants->capacity);
+    ConstantSlot* slots = ALLOCATE(ConstantSlot, capacity);
+    for (int i = 0; i < capacity; i++)
     {
-        error("Too many constants in one chunk");
+        slots[i].index = -1;
+    }
+
+    for (int i = 0; i < constants->capacity; i++)
+    {
+        ConstantSlot* slot = &constants->slots[i];
+        if (slot->index != -1) *findConstantSlot(slots, capacity, slot->value) = *slot;
+    }
+
+    FREE_ARRAY(ConstantSlot, constants->slots, constants->capacity);
+    constants->slots = slots;
+    constants->capacity = capacity;
+}
+
+static int makeConstant(Parser* parser, Value value)
+{
+    ConstantIndex* constants = &parser->compiler->constants;
+    if ((constants->count + 1) * 4 > constants->capacity * 3) growConstantIndex(constants);
+
+    ConstantSlot* slot = findConstantSlot(constants->slots, constants->capacity, value);
+    if (slot->index == -1)
+    {
+        slot->value = value;
+        slot->index = addConstant(currentChunk(parser), value);
+        constants->count++;
+
+        // A lazily compiled body adds to a function that may be old.
+        writeBarrier((Obj*)parser->compiler->function, value);
+    }
+
+    int constant = slot->index;
+    if (constant > UINT24_MAX)
+    {
+        error(parser, "Too many constants in one chunk");
         return 0;
     }
-    return (uint8_t)constant;
+    return constant;
 }
 
-static void emitConstant(Value value)
+static void emitConstant(Parser* parser, Value value)
 {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    emitConstantOp(parser, OP_CONSTANT, OP_CONSTANT_LONG, makeConstant(parser, value));
 }
 
-static void patchJump(int offset)
+static void patchJump(Parser* parser, int handle)
 {
-    // -2 to adjust for the bytecode for the jump offset itself
-    int jump = currentChunk()->count - offset - 2;
+    // Something now jumps to the end of the code emitted so far, so
+    // the last comparison no longer produces the only value there.
+    parser->compiler->comparisonEnd = -1;
 
-    if (jump > UINT16_MAX) error("if-block contains too much code.");
+    Compiler* compiler = parser->compiler;
+    targetJump(parser, &compiler->jumps[handle]);
+    compiler->jumps[handle].offset = -1;
 
-    jump = (uint16_t)jump;
+    while (compiler->jumpCount > 0 && compiler->jumps[compiler->jumpCount - 1].offset == -1)
+    {
+        compiler->jumpCount--;
+    }
+}
 
-    currentChunk()->code[offset] = (jump >> 8) & 0xff;  // get top 8 bits of 'jump'
-    currentChunk()->code[offset + 1] = jump & 0xff;     // and bottom 8 bits
+/*
+ * Makes room for one more local, or returns NULL (after reporting it) if
+ * the function already has as many as a slot operand can address.
+ */
+static Local* newLocal(Parser* parser)
+{
+    Compiler* compiler = parser->compiler;
+    if (compiler->localCount == UINT16_COUNT)
+    {
+        error(parser, "Too many local variables in function.");
+        return NULL;
+    }
+
+    if (compiler->localCapacity < compiler->localCount + 1)
+    {
+        int oldCapacity = compiler->localCapacity;
+        compiler->localCapacity = NEW_ARRAY_CAPACITY(oldCapacity);
+        compiler->locals = GROW_ARRAY(Local, compiler->locals, oldCapacity, compiler->localCapacity);
+    }
+
+    if (compiler->localCount + 1 > compiler->function->stackSlots)
+    {
+        compiler->function->stackSlots = compiler->localCount + 1;
+    }
+    return &compiler->locals[compiler->localCount++];
 }
 
-static void initCompiler(Compiler* compiler, FunctionType functionType)
+static void initCompiler(Parser* parser, Compiler* compiler, ObjFunction* function, FunctionType functionType)
 {
-    compiler->enclosing = current;
+    compiler->enclosing = parser->compiler;
     compiler->function = NULL;
     compiler->functionType = functionType;
+    compiler->locals = NULL;
     compiler->localCount = 0;
+    compiler->localCapacity = 0;
     compiler->scopeDepth = 0;
-    compiler->function = newFunction();
-    current = compiler;
-    if (functionType != TYPE_SCRIPT)
+    compiler->comparisonEnd = -1;
+    compiler->capturedNames = NULL;
+    compiler->constants.count = 0;
+    compiler->constants.capacity = 0;
+    compiler->constants.slots = NULL;
+    compiler->jumps = NULL;
+    compiler->jumpCount = 0;
+    compiler->jumpCapacity = 0;
+    compiler->arenaMark = arenaMark(&parser->arena);
+    compiler->function = function != NULL ? function : newFunction();
+    compiler->function->chunk.arena = &parser->arena;
+    parser->compiler = compiler;
+    if (function == NULL && functionType != TYPE_SCRIPT)
     {
-        current->function->name = copyString(parser.previous.lexeme_start, parser.previous.lexeme_length);
+        ObjFunction* named = parser->compiler->function;
+        named->name = copyString(parser->previous.lexeme_start, parser->previous.lexeme_length);
+        writeBarrier((Obj*)named, OBJ_VAL(named->name));
     }
 
-    Local* local = &current->locals[current->localCount++];
+    Local* local = newLocal(parser);
     local->depth = 0;
     local->isCaptured = false;
 
@@ -294,48 +597,58 @@ static void initCompiler(Compiler* compiler, FunctionType functionType)
     }
 }
 
-static ObjFunction* endCompiler()
+static ObjFunction* endCompiler(Parser* parser)
 {
-    emitReturn();
-    ObjFunction* function = current->function;
+    emitReturn(parser);
+    ObjFunction* function = parser->compiler->function;
 
 #ifdef DEBUG_PRINT_CODE
-    disassembleChunk(currentChunk(), function->name !=  NULL
+    disassembleChunk(currentChunk(parser), function->name !=  NULL
             ? function->name->chars
             : "<script>");
 #endif
 
-    current = current->enclosing;
+    // Functions nest, so everything on the arena past the mark belongs to
+    // this one's chunk, or to chunks of functions in it that are done.
+    Compiler* compiler = parser->compiler;
+    finishChunk(currentChunk(parser));
+    arenaRelease(&parser->arena, compiler->arenaMark);
+
+    FREE_ARRAY(ConstantSlot, compiler->constants.slots, compiler->constants.capacity);
+    FREE_ARRAY(Local, compiler->locals, compiler->localCapacity);
+    FREE_ARRAY(PendingJump, compiler->jumps, compiler->jumpCapacity);
+
+    parser->compiler = parser->compiler->enclosing;
     return function;
 }
 
-static void beginScope()
+static void beginScope(Parser* parser)
 {
-    current->scopeDepth++;
+    parser->compiler->scopeDepth++;
 }
 
-static void endScope()
+static void endScope(Parser* parser)
 {
-    current->scopeDepth--;
+    parser->compiler->scopeDepth--;
 
-    while (current->localCount > 0 
-        && current->locals[current->localCount -1].depth > current->scopeDepth)
+    while (parser->compiler->localCount > 0 
+        && parser->compiler->locals[parser->compiler->localCount -1].depth > parser->compiler->scopeDepth)
     {
-        if (current->locals[current->localCount - 1].isCaptured)
+        if (parser->compiler->locals[parser->compiler->localCount - 1].isCaptured)
         {
-            emitByte(OP_CLOSE_UPVALUE);
+            emitByte(parser, OP_CLOSE_UPVALUE);
         }
         else
         {
-            emitByte(OP_POP); 
+            emitByte(parser, OP_POP); 
         }
-        current->localCount--;
+        parser->compiler->localCount--;
     }
 }
 
-static uint8_t identifierConstant(Token* name)
+static int identifierConstant(Parser* parser, Token* name)
 {
-    return makeConstant(OBJ_VAL(copyString(name->lexeme_start, name->lexeme_length)));
+    return makeConstant(parser, OBJ_VAL(copyString(name->lexeme_start, name->lexeme_length)));
 }
 
 static bool identifiersEqual(Token* a, Token* b)
@@ -344,7 +657,7 @@ static bool identifiersEqual(Token* a, Token* b)
     return memcmp(a->lexeme_start, b->lexeme_start, a->lexeme_length) == 0;
 }
 
-static int resolveLocal(Compiler* compiler, Token* name)
+static int resolveLocal(Parser* parser, Compiler* compiler, Token* name)
 {
     for (int i = compiler->localCount - 1; i >= 0; i--)
     {
@@ -353,7 +666,7 @@ static int resolveLocal(Compiler* compiler, Token* name)
         {
             if (local->depth == -1)
             {
-                error("Can't read local variable in its own initializer.");
+                error(parser, "Can't read local variable in its own initializer.");
             }
             return i;
         }
@@ -362,7 +675,7 @@ static int resolveLocal(Compiler* compiler, Token* name)
     return -1;
 }
 
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal)
+static int addUpvalue(Parser* parser, Compiler* compiler, uint16_t index, bool isLocal)
 {
     int upvalueCount = compiler->function->upvalueCount;
 
@@ -377,7 +690,7 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal)
 
     if (upvalueCount == UINT8_COUNT)
     {
-        error("Too many closure variables in function.");
+        error(parser, "Too many closure variables in function.");
         return 0;
     }
     
@@ -386,246 +699,272 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal)
     return compiler->function->upvalueCount++;
 }
 
-static int resolveUpvalue(Compiler* compiler, Token* name)
+/*
+ * A lazily compiled body has no enclosing compilers left to search; the
+ * variables it captures were resolved back when it was declared.
+ */
+static int resolveCapturedName(Compiler* compiler, Token* name)
 {
-    if (compiler->enclosing == NULL) return -1;
+    if (compiler->capturedNames == NULL) return -1;
 
-    int local = resolveLocal(compiler->enclosing, name);
+    for (int i = 0; i < compiler->function->upvalueCount; i++)
+    {
+        if (identifiersEqual(name, &compiler->capturedNames[i])) return i;
+    }
+    return -1;
+}
+
+static int resolveUpvalue(Parser* parser, Compiler* compiler, Token* name)
+{
+    if (compiler->enclosing == NULL) return resolveCapturedName(compiler, name);
+
+    int local = resolveLocal(parser, compiler->enclosing, name);
     if (local != -1)
     {
         compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t)local, true);
+        return addUpvalue(parser, compiler, (uint16_t)local, true);
     }
 
-    int upvalue = resolveUpvalue(compiler->enclosing, name);
+    int upvalue = resolveUpvalue(parser, compiler->enclosing, name);
     if (upvalue != -1)
     {
-        return addUpvalue(compiler, (uint8_t)upvalue, false);
+        return addUpvalue(parser, compiler, (uint16_t)upvalue, false);
     }
 
     return -1;
 }
 
-static void addLocal(Token name)
+static void addLocal(Parser* parser, Token name)
 {
-    if (current->localCount == UINT8_COUNT)
-    {
-        error("Too many local variables in function.");
-        return;
-    }
+    Local* local = newLocal(parser);
+    if (local == NULL) return;
 
-    Local* local = &current->locals[current->localCount++];
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
 }
 
-static void declareVariable()
+static void declareVariable(Parser* parser)
 {
-    if (current->scopeDepth == 0) return;
+    if (parser->compiler->scopeDepth == 0) return;
 
-    Token* name = &parser.previous;
-    for (int i = current->localCount - 1; i >= 0; i--)
+    Token* name = &parser->previous;
+    for (int i = parser->compiler->localCount - 1; i >= 0; i--)
     {
-        Local* local = &current->locals[i];
-        if (local->depth != -1 && local->depth < current->scopeDepth)
+        Local* local = &parser->compiler->locals[i];
+        if (local->depth != -1 && local->depth < parser->compiler->scopeDepth)
         {
             break;
         }
 
         if (identifiersEqual(name, &local->name))
         {
-             error("Already a variable with this name in this scope.");
+             error(parser, "Already a variable with this name in this scope.");
         }
     }
 
-    addLocal(*name);
+    addLocal(parser, *name);
 }
 
-static uint8_t parseVariable(const char* errorMessage)
+static int parseVariable(Parser* parser, const char* errorMessage)
 {
-    consume(TOKEN_IDENTIFIER, errorMessage);
+    consume(parser, TOKEN_IDENTIFIER, errorMessage);
 
-    declareVariable();
-    if (current->scopeDepth > 0) return 0;
+    declareVariable(parser);
+    if (parser->compiler->scopeDepth > 0) return 0;
 
-    return identifierConstant(&parser.previous);
+    return identifierConstant(parser, &parser->previous);
 }
 
-static void markInitialized()
+static void markInitialized(Parser* parser)
 {
-    if (current->scopeDepth == 0) return;
-    current->locals[current->localCount -1].depth = current->scopeDepth;
+    if (parser->compiler->scopeDepth == 0) return;
+    parser->compiler->locals[parser->compiler->localCount -1].depth = parser->compiler->scopeDepth;
 }
 
-static void defineVariable(uint8_t global)
+static void defineVariable(Parser* parser, int global)
 {
-    if (current->scopeDepth > 0) {
-        markInitialized();
+    if (parser->compiler->scopeDepth > 0) {
+        markInitialized(parser);
         return;
     }
 
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitConstantOp(parser, OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global);
 }
 
-static uint8_t argumentList()
+static uint8_t argumentList(Parser* parser)
 {
     uint8_t argCount = 0;
-    if (!check(TOKEN_RIGHT_PAREN))
+    if (!check(parser, TOKEN_RIGHT_PAREN))
     {
         do
         {
-            expression();
-            if(argCount == 255) error("Can't have more than 255 arguments.");
+            expression(parser);
+            if(argCount == 255) error(parser, "Can't have more than 255 arguments.");
             argCount++;
         }
-        while (match(TOKEN_COMMA));
+        while (match(parser, TOKEN_COMMA));
     }
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
     return argCount;
 }
 
-static void and_(bool canAssign)
+static void and_(Parser* parser, bool canAssign)
 {
-    int endJump = emitJump(OP_JUMP_IF_FALSE);
+    int endJump = emitJump(parser, OP_JUMP_IF_FALSE);
 
-    emitByte(OP_POP);
-    parsePrecedence(PREC_AND);
+    emitByte(parser, OP_POP);
+    parsePrecedence(parser, PREC_AND);
 
-    patchJump(endJump);
+    patchJump(parser, endJump);
 }
 
-static void binary(bool canAssign)
+static void binary(Parser* parser, bool canAssign)
 {
-    TokenType operatorType = parser.previous.type;
+    TokenType operatorType = parser->previous.type;
     ParseRule* rule = getRule(operatorType);
-    parsePrecedence((Precedence)(rule->precedence + 1));
+    parsePrecedence(parser, (Precedence)(rule->precedence + 1));
 
+    int start = currentChunk(parser)->count;
+    uint8_t jump;
     switch (operatorType)
     {
-        case TOKEN_BANG_EQUAL:      emitBytes(OP_EQUAL, OP_NOT); break;
-        case TOKEN_EQUAL_EQUAL:     emitByte(OP_EQUAL); break;
-        case TOKEN_GREATER:         emitByte(OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL:   emitBytes(OP_LESS, OP_NOT); break;
-        case TOKEN_LESS:            emitByte(OP_LESS); break;
-        case TOKEN_LESS_EQUAL:      emitBytes(OP_GREATER, OP_NOT); break;
-        case TOKEN_MINUS:           emitByte(OP_SUBTRACT); break;
-        case TOKEN_PLUS:            emitByte(OP_ADD); break;
-        case TOKEN_SLASH:           emitByte(OP_DIVIDE); break;
-        case TOKEN_STAR:            emitByte(OP_MULTIPLY); break;
+        case TOKEN_BANG_EQUAL:      emitBytes(parser, OP_EQUAL, OP_NOT); jump = OP_JUMP_IF_EQUAL; break;
+        case TOKEN_EQUAL_EQUAL:     emitByte(parser, OP_EQUAL); jump = OP_JUMP_IF_NOT_EQUAL; break;
+        case TOKEN_GREATER:         emitByte(parser, OP_GREATER); jump = OP_JUMP_IF_NOT_GREATER; break;
+        case TOKEN_GREATER_EQUAL:   emitBytes(parser, OP_LESS, OP_NOT); jump = OP_JUMP_IF_LESS; break;
+        case TOKEN_LESS:            emitByte(parser, OP_LESS); jump = OP_JUMP_IF_NOT_LESS; break;
+        case TOKEN_LESS_EQUAL:      emitBytes(parser, OP_GREATER, OP_NOT); jump = OP_JUMP_IF_GREATER; break;
+        case TOKEN_MINUS:           emitByte(parser, OP_SUBTRACT); return;
+        case TOKEN_PLUS:            emitByte(parser, OP_ADD); return;
+        case TOKEN_SLASH:           emitByte(parser, OP_DIVIDE); return;
+        case TOKEN_STAR:            emitByte(parser, OP_MULTIPLY); return;
         default: return;
     }
+
+    parser->compiler->comparisonStart = start;
+    parser->compiler->comparisonEnd = currentChunk(parser)->count;
+    parser->compiler->comparisonJump = jump;
 }
 
-static void call(bool canAssign)
+static void call(Parser* parser, bool canAssign)
 {
-    uint8_t argCount = argumentList();
-    emitBytes(OP_CALL, argCount);
+    uint8_t argCount = argumentList(parser);
+    emitBytes(parser, OP_CALL, argCount);
 }
 
-static void dot(bool canAssign) {
-    consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifierConstant(&parser.previous);
+static void dot(Parser* parser, bool canAssign) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect property name after '.'.");
+    int name = identifierConstant(parser, &parser->previous);
 
-    if (canAssign && match(TOKEN_EQUAL))
+    if (canAssign && match(parser, TOKEN_EQUAL))
     {
-        expression();
-        emitBytes(OP_SET_PROPERTY, name);
+        expression(parser);
+        emitConstantOp(parser, OP_SET_PROPERTY, OP_SET_PROPERTY_LONG, name);
     } 
-    else if (match(TOKEN_LEFT_PAREN))
+    else if (match(parser, TOKEN_LEFT_PAREN))
     {
-        uint8_t argCount = argumentList();
-        emitBytes(OP_INVOKE, name);
-        emitByte(argCount);
+        uint8_t argCount = argumentList(parser);
+        emitConstantOp(parser, OP_INVOKE, OP_INVOKE_LONG, name);
+        emitByte(parser, argCount);
     }
     else
     {
-        emitBytes(OP_GET_PROPERTY, name);
+        emitConstantOp(parser, OP_GET_PROPERTY, OP_GET_PROPERTY_LONG, name);
     }
 }
 
-static void literal(bool canAssign)
+static void literal(Parser* parser, bool canAssign)
 {
-    switch (parser.previous.type)
+    switch (parser->previous.type)
     {
-        case TOKEN_TRUE: emitByte(OP_TRUE); break;
-        case TOKEN_FALSE: emitByte(OP_FALSE); break;
-        case TOKEN_NIL: emitByte(OP_NIL); break;
+        case TOKEN_TRUE: emitByte(parser, OP_TRUE); break;
+        case TOKEN_FALSE: emitByte(parser, OP_FALSE); break;
+        case TOKEN_NIL: emitByte(parser, OP_NIL); break;
         default: return;
     }
 }
 
-static void grouping(bool canAssign)
+static void grouping(Parser* parser, bool canAssign)
 {
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static void number(bool canAssign)
+static void number(Parser* parser, bool canAssign)
 {
-    double value = strtod(parser.previous.lexeme_start, NULL);
-    emitConstant(NUMBER_VAL(value));
+    double value = strtod(parser->previous.lexeme_start, NULL);
+    emitConstant(parser, NUMBER_VAL(value));
 }
 
-static void or_(bool canAssign)
+static void or_(Parser* parser, bool canAssign)
 {
-    int elseJump = emitJump(OP_JUMP_IF_FALSE);
-    int endJump = emitJump(OP_JUMP);
+    int elseJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    int endJump = emitJump(parser, OP_JUMP);
 
-    patchJump(elseJump);
-    emitByte(OP_POP);
+    patchJump(parser, elseJump);
+    emitByte(parser, OP_POP);
 
-    parsePrecedence(PREC_OR);
-    patchJump(endJump);
+    parsePrecedence(parser, PREC_OR);
+    patchJump(parser, endJump);
 }
 
-static void string(bool canAssign)
+static void string(Parser* parser, bool canAssign)
 {
     emitConstant(
+            parser,
             OBJ_VAL(
                 copyString(
-                    parser.previous.lexeme_start + 1,   // + 1 to remove '"'
-                    parser.previous.lexeme_length - 2   // -2 to remove '"' and account for length vs 0-index
+                    parser->previous.lexeme_start + 1,   // + 1 to remove '"'
+                    parser->previous.lexeme_length - 2   // -2 to remove '"' and account for length vs 0-index
                 )
             )
         );
 }
 
-static void namedVariable(Token name, bool canAssign)
+static void namedVariable(Parser* parser, Token name, bool canAssign)
 {
     uint8_t getOp, setOp;
-    int arg = resolveLocal(current, &name);
-    if (arg != -1)
+    int arg = resolveLocal(parser, parser->compiler, &name);
+    if (arg > UINT8_MAX)
+    {
+        getOp = OP_GET_LOCAL_LONG;
+        setOp = OP_SET_LOCAL_LONG;
+    }
+    else if (arg != -1)
     {
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
     }
-    else if ((arg = resolveUpvalue(current, &name)) != -1)
+    else if ((arg = resolveUpvalue(parser, parser->compiler, &name)) != -1)
     {
         getOp = OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     }
     else 
     {
-        arg = identifierConstant(&name);
-        getOp = OP_GET_GLOBAL;
-        setOp = OP_SET_GLOBAL;
+        arg = identifierConstant(parser, &name);
+        bool isLong = arg > UINT8_MAX;
+        getOp = isLong ? OP_GET_GLOBAL_LONG : OP_GET_GLOBAL;
+        setOp = isLong ? OP_SET_GLOBAL_LONG : OP_SET_GLOBAL;
     }
 
-    if (canAssign && match(TOKEN_EQUAL))
-    {
-        expression();
-        emitBytes(setOp, (uint8_t)arg);
-    }
-    else
+    uint8_t op = getOp;
+    if (canAssign && match(parser, TOKEN_EQUAL))
     {
-        emitBytes(getOp, (uint8_t)arg);
+        expression(parser);
+        op = setOp;
     }
+
+    emitByte(parser, op);
+    if (op == OP_GET_LOCAL_LONG || op == OP_SET_LOCAL_LONG) emitUint16(parser, arg);
+    else if (op == OP_GET_GLOBAL_LONG || op == OP_SET_GLOBAL_LONG) emitUint24(parser, arg);
+    else emitByte(parser, (uint8_t)arg);
 }
 
-static void variable(bool canAssign)
+static void variable(Parser* parser, bool canAssign)
 {
-    namedVariable(parser.previous, canAssign);
+    namedVariable(parser, parser->previous, canAssign);
 }
 
 static Token syntheticToken(const char* text) {
@@ -635,53 +974,53 @@ static Token syntheticToken(const char* text) {
     return token;
 }
 
-static void super_(bool canAssign)
+static void super_(Parser* parser, bool canAssign)
 {
-    if (currentClass == NULL)
+    if (parser->currentClass == NULL)
     {
-        error("Can't use 'super' outside of a class.'");
+        error(parser, "Can't use 'super' outside of a class.'");
     }
-    else if (currentClass->hasSuperClass == false)
+    else if (parser->currentClass->hasSuperClass == false)
     {
-       error("Can't use 'super' in a class without a parent.");
+       error(parser, "Can't use 'super' in a class without a parent.");
     }
 
-    consume(TOKEN_DOT, "Expect '.' after 'super'.");
-    consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifierConstant(&parser.previous);
+    consume(parser, TOKEN_DOT, "Expect '.' after 'super'.");
+    consume(parser, TOKEN_IDENTIFIER, "Expect superclass method name.");
+    int name = identifierConstant(parser, &parser->previous);
 
-    namedVariable(syntheticToken("this"), false);
-    if (match(TOKEN_LEFT_PAREN))
+    namedVariable(parser, syntheticToken("this"), false);
+    if (match(parser, TOKEN_LEFT_PAREN))
     {
-        uint8_t argCount = argumentList();
-        namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_SUPER_INVOKE, name);
-        emitByte(argCount);
+        uint8_t argCount = argumentList(parser);
+        namedVariable(parser, syntheticToken("super"), false);
+        emitConstantOp(parser, OP_SUPER_INVOKE, OP_SUPER_INVOKE_LONG, name);
+        emitByte(parser, argCount);
     }
     else
     {
-        namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_GET_SUPER, name);
+        namedVariable(parser, syntheticToken("super"), false);
+        emitConstantOp(parser, OP_GET_SUPER, OP_GET_SUPER_LONG, name);
     }
 }
 
-static void this_(bool canAssign)
+static void this_(Parser* parser, bool canAssign)
 {
-    if (currentClass == NULL) {
-        error("Can't use 'this' outside of a class.");
+    if (parser->currentClass == NULL) {
+        error(parser, "Can't use 'this' outside of a class.");
         return;
     }
-    variable(false);
+    variable(parser, false);
 }
 
-static void unary(bool canAssign)
+static void unary(Parser* parser, bool canAssign)
 {
-    TokenType operatorType = parser.previous.type;
-    parsePrecedence(PREC_UNARY); // compile operand
+    TokenType operatorType = parser->previous.type;
+    parsePrecedence(parser, PREC_UNARY); // compile operand
     switch (operatorType)
     {
-        case TOKEN_BANG: emitByte(OP_NOT); break;
-        case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+        case TOKEN_BANG: emitByte(parser, OP_NOT); break;
+        case TOKEN_MINUS: emitByte(parser, OP_NEGATE); break;
         default: return;
     }
 }
@@ -717,6 +1056,7 @@ ParseRule rules[] =
     [TOKEN_FOR]		    = {NULL,	    NULL,	PREC_NONE},
     [TOKEN_FUN]		    = {NULL,	    NULL,	PREC_NONE},
     [TOKEN_IF]		    = {NULL,	    NULL,	PREC_NONE},
+    [TOKEN_IMPORT]	    = {NULL,	    NULL,	PREC_NONE},
     [TOKEN_NIL]		    = {literal,	    NULL,	PREC_NONE},
     [TOKEN_OR]		    = {NULL,	    or_,	PREC_OR},
     [TOKEN_PRINT]	    = {NULL,	    NULL,	PREC_NONE},
@@ -730,29 +1070,29 @@ ParseRule rules[] =
     [TOKEN_EOF]		    = {NULL,	    NULL,	PREC_NONE},
 };
 
-static void parsePrecedence(Precedence precedence)
+static void parsePrecedence(Parser* parser, Precedence precedence)
 {
-    advance();
-    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+    advance(parser);
+    ParseFn prefixRule = getRule(parser->previous.type)->prefix;
     if (prefixRule == NULL)
     {
-        error("Expect expression.");
+        error(parser, "Expect expression.");
         return;
     }
 
     bool canAssign = precedence <= PREC_ASSIGNMENT;
-    prefixRule(canAssign);
+    prefixRule(parser, canAssign);
 
-    while (precedence <= getRule(parser.current.type)->precedence)
+    while (precedence <= getRule(parser->current.type)->precedence)
     {
-        advance();
-        ParseFn infixRule = getRule(parser.previous.type)->infix;
-        infixRule(canAssign);
+        advance(parser);
+        ParseFn infixRule = getRule(parser->previous.type)->infix;
+        infixRule(parser, canAssign);
     }
 
-    if (canAssign && match(TOKEN_EQUAL))
+    if (canAssign && match(parser, TOKEN_EQUAL))
     {
-        error("Invalid assignment target.");
+        error(parser, "Invalid assignment target.");
     }
 }
 
@@ -761,287 +1101,450 @@ static ParseRule* getRule(TokenType type)
     return &rules[type];
 }
 
-static void expression()
+static void expression(Parser* parser)
 {
-    parsePrecedence(PREC_ASSIGNMENT);
+    parsePrecedence(parser, PREC_ASSIGNMENT);
 }
 
-static void block()
+static void block(Parser* parser)
 {
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF))
     {
-        declaration();
+        declaration(parser);
     }
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type)
+static void functionBody(Parser* parser)
 {
-    Compiler compiler;
-    initCompiler(&compiler, type);
-    beginScope();
+    beginScope(parser);
 
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
-    if (!check(TOKEN_RIGHT_PAREN))
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    if (!check(parser, TOKEN_RIGHT_PAREN))
     {
         do 
         {
-            current->function->arity++;
-            if (current->function->arity > 255)
+            parser->compiler->function->arity++;
+            if (parser->compiler->function->arity > 255)
+            {
+                errorAtCurrent(parser, "Can't have more than 255 parameters.");
+            }
+            int constant = parseVariable(parser, "Expect parameter name.");
+            defineVariable(parser, constant);
+        }
+        while (match(parser, TOKEN_COMMA));
+    }
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    block(parser);
+}
+
+static void emitCaptures(Parser* parser, Compiler* compiler)
+{
+    for (int i = 0; i < compiler->function->upvalueCount; i++)
+    {
+        emitByte(parser, compiler->upvalues[i].isLocal ? 1 : 0);
+        emitUint16(parser, compiler->upvalues[i].index);
+    }
+}
+
+/*
+ * Declares a function without compiling its body. The parameters are only
+ * counted and the body is skipped token by token, treating every name in
+ * it that resolves to an enclosing variable as captured. That can capture
+ * more than the body really uses (e.g. a name it shadows), which costs an
+ * upvalue but never changes what a name refers to.
+ */
+static void lazyFunction(Parser* parser, FunctionType type)
+{
+    ObjFunction* function = newFunction();
+    int constant = makeConstant(parser, OBJ_VAL(function));
+    function->name = copyString(parser->previous.lexeme_start, parser->previous.lexeme_length);
+    writeBarrier((Obj*)function, OBJ_VAL(function->name));
+
+    // Only used to resolve captures against the enclosing compilers.
+    Compiler compiler;
+    compiler.enclosing = parser->compiler;
+    compiler.function = function;
+
+    const char* source = parser->current.lexeme_start;
+    int line = parser->current.src_code_line;
+    Token names[UINT8_COUNT];
+
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    if (!check(parser, TOKEN_RIGHT_PAREN))
+    {
+        do
+        {
+            function->arity++;
+            if (function->arity > 255)
             {
-                errorAtCurrent("Can't have more than 255 parameters.");
+                errorAtCurrent(parser, "Can't have more than 255 parameters.");
             }
-            uint8_t constant = parseVariable("Expect parameter name.");
-            defineVariable(constant);
+            consume(parser, TOKEN_IDENTIFIER, "Expect parameter name.");
         }
-        while (match(TOKEN_COMMA));
+        while (match(parser, TOKEN_COMMA));
     }
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
-    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-    block();
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+
+    int depth = 1;
+    while (!check(parser, TOKEN_EOF))
+    {
+        if (check(parser, TOKEN_LEFT_BRACE))
+        {
+            depth++;
+        }
+        else if (check(parser, TOKEN_RIGHT_BRACE))
+        {
+            if (--depth == 0) break;
+        }
+        else if ((check(parser, TOKEN_IDENTIFIER) || check(parser, TOKEN_THIS) || check(parser, TOKEN_SUPER))
+            && parser->previous.type != TOKEN_DOT)
+        {
+            int upvalue = resolveUpvalue(parser, &compiler, &parser->current);
+            if (upvalue != -1) names[upvalue] = parser->current;
 
-    ObjFunction* function = endCompiler();
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+            // super_() loads 'this' as well.
+            if (check(parser, TOKEN_SUPER))
+            {
+                Token this = syntheticToken("this");
+                upvalue = resolveUpvalue(parser, &compiler, &this);
+                if (upvalue != -1) names[upvalue] = this;
+            }
+        }
+        advance(parser);
+    }
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 
+    Token* upvalueNames = ALLOCATE(Token, function->upvalueCount);
     for (int i = 0; i < function->upvalueCount; i++)
     {
-        emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-        emitByte(compiler.upvalues[i].index);
+        upvalueNames[i] = names[i];
     }
+
+    LazyBody* body = ALLOCATE(LazyBody, 1);
+    body->source = source;
+    body->line = line;
+    body->functionType = type;
+    body->inClass = parser->currentClass != NULL;
+    body->hasSuperClass = parser->currentClass != NULL && parser->currentClass->hasSuperClass;
+    body->path = parser->path;
+    body->upvalueNames = upvalueNames;
+    function->lazyBody = body;
+
+    emitConstantOp(parser, OP_CLOSURE, OP_CLOSURE_LONG, constant);
+    emitCaptures(parser, &compiler);
 }
 
-static void method() {
-    consume(TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t constant = identifierConstant(&parser.previous);
+static void function(Parser* parser, FunctionType type)
+{
+    if (vm.lazyCompile)
+    {
+        lazyFunction(parser, type);
+        return;
+    }
+
+    Compiler compiler;
+    initCompiler(parser, &compiler, NULL, type);
+    functionBody(parser);
+
+    ObjFunction* function = endCompiler(parser);
+    emitConstantOp(parser, OP_CLOSURE, OP_CLOSURE_LONG, makeConstant(parser, OBJ_VAL(function)));
+    emitCaptures(parser, &compiler);
+}
+
+static void method(Parser* parser) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect method name.");
+    int constant = identifierConstant(parser, &parser->previous);
     FunctionType type = TYPE_METHOD;
-    if (parser.previous.lexeme_length == 4 
-        && memcmp(parser.previous.lexeme_start, "init", 4) == 0)
+    if (parser->previous.lexeme_length == 4 
+        && memcmp(parser->previous.lexeme_start, "init", 4) == 0)
     {
         type = TYPE_INITIALIZER;
     }
-    function(type);
-    emitBytes(OP_METHOD, constant);
+    function(parser, type);
+    emitConstantOp(parser, OP_METHOD, OP_METHOD_LONG, constant);
 }
 
-static void classDeclaration() {
-    consume(TOKEN_IDENTIFIER, "Expect class name.");
-    Token className = parser.previous;
-    uint8_t nameConstant = identifierConstant(&parser.previous);
-    declareVariable();
+static void classDeclaration(Parser* parser) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect class name.");
+    Token className = parser->previous;
+    int nameConstant = identifierConstant(parser, &parser->previous);
+    declareVariable(parser);
 
-    emitBytes(OP_CLASS, nameConstant);
-    defineVariable(nameConstant);
+    emitConstantOp(parser, OP_CLASS, OP_CLASS_LONG, nameConstant);
+    defineVariable(parser, nameConstant);
 
     ClassCompiler classCompiler;
-    classCompiler.enclosing = currentClass;
+    classCompiler.enclosing = parser->currentClass;
     classCompiler.hasSuperClass = false;
-    currentClass = &classCompiler;
+    parser->currentClass = &classCompiler;
 
-    if (match(TOKEN_LESS))
+    if (match(parser, TOKEN_LESS))
     {
-        consume(TOKEN_IDENTIFIER, "Expect superclass name.");
-        variable(false);
+        consume(parser, TOKEN_IDENTIFIER, "Expect superclass name.");
+        variable(parser, false);
 
-        if (identifiersEqual(&className, &parser.previous))
+        if (identifiersEqual(&className, &parser->previous))
         {
-            error("A class can't inherit from itself.");
+            error(parser, "A class can't inherit from itself.");
         }
 
-        beginScope();
-        addLocal(syntheticToken("super"));
-        defineVariable(0);
+        beginScope(parser);
+        addLocal(parser, syntheticToken("super"));
+        defineVariable(parser, 0);
 
-        namedVariable(className, false);
-        emitByte(OP_INHERIT);
+        namedVariable(parser, className, false);
+        emitByte(parser, OP_INHERIT);
         classCompiler.hasSuperClass = true;
     }
 
-    namedVariable(className, false);
-    consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-        method();
+    namedVariable(parser, className, false);
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+        method(parser);
     }
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
-    emitByte(OP_POP);
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+    emitByte(parser, OP_POP);
 
     if (classCompiler.hasSuperClass)
     {
-        endScope();
+        endScope(parser);
     }
 
-    currentClass = currentClass->enclosing;
+    parser->currentClass = parser->currentClass->enclosing;
 }
 
-static void funDeclaration()
+static void funDeclaration(Parser* parser)
 {
-    uint8_t global = parseVariable("Expect function name.");
-    markInitialized();
-    function(TYPE_FUNCTION);
-    defineVariable(global);
+    int global = parseVariable(parser, "Expect function name.");
+    markInitialized(parser);
+    function(parser, TYPE_FUNCTION);
+    defineVariable(parser, global);
 }
 
-static void varDeclaration()
+static void varDeclaration(Parser* parser)
 {
-    uint8_t global = parseVariable("Expect variable name.");
+    int global = parseVariable(parser, "Expect variable name.");
 
-    if (match(TOKEN_EQUAL)) 
+    if (match(parser, TOKEN_EQUAL)) 
     {
-        expression();
+        expression(parser);
     }
     else 
     {
-        emitByte(OP_NIL);
+        emitByte(parser, OP_NIL);
     }
 
-    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 
-    defineVariable(global);
+    defineVariable(parser, global);
 }
 
-static void expressionStatement()
+static void expressionStatement(Parser* parser)
 {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emitByte(OP_POP);
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+    emitByte(parser, OP_POP);
+}
+
+/*
+ * Emits the jump that skips a statement body when its condition is
+ * false. If the condition ended in a comparison, that comparison is
+ * replaced by a fused compare-and-branch which pops both operands,
+ * so no bool is left behind and 'fused' tells the caller not to pop.
+ */
+static int emitConditionJump(Parser* parser, bool* fused)
+{
+    *fused = parser->compiler->comparisonEnd == currentChunk(parser)->count;
+    if (*fused)
+    {
+        currentChunk(parser)->count = parser->compiler->comparisonStart;
+        parser->compiler->comparisonEnd = -1;
+        return emitJump(parser, parser->compiler->comparisonJump);
+    }
+
+    int jump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP); // Pop condition
+    return jump;
 }
 
-static void forStatement()
+static void forStatement(Parser* parser)
 {
-    beginScope();
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    beginScope(parser);
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
 
     // parse initializer if here
-    if (match(TOKEN_SEMICOLON))
+    if (match(parser, TOKEN_SEMICOLON))
     {
         // no init
     }
-    else if (match(TOKEN_VAR))
+    else if (match(parser, TOKEN_VAR))
     {
-        varDeclaration();
+        varDeclaration(parser);
     }
     else
     {
-        expressionStatement();
+        expressionStatement(parser);
     }
 
     // parse condition
-    int loopStart = currentChunk()->count;
+    int loopStart = currentChunk(parser)->count;
     int exitJump = -1;
-    if (!match(TOKEN_SEMICOLON))
+    bool fused = false;
+    if (!match(parser, TOKEN_SEMICOLON))
     {
-        expression();
-        consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
         // Jump out of the loop if the condition is false
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP); // Pop condition
+        exitJump = emitConditionJump(parser, &fused);
     }
 
     // parse increment clause
-    if (!match(TOKEN_RIGHT_PAREN))
+    if (!match(parser, TOKEN_RIGHT_PAREN))
     {
-        int bodyJump = emitJump(OP_JUMP);
-        int incrementStart = currentChunk()->count;
-        expression();
-        emitByte(OP_POP);
-        consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clause.");
+        int bodyJump = emitJump(parser, OP_JUMP);
+        int incrementStart = currentChunk(parser)->count;
+        expression(parser);
+        emitByte(parser, OP_POP);
+        consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clause.");
 
-        emitLoop(loopStart);
+        emitLoop(parser, loopStart);
         loopStart = incrementStart;
-        patchJump(bodyJump);
+        patchJump(parser, bodyJump);
     }
 
-    statement();
-    emitLoop(loopStart);
+    statement(parser);
+    emitLoop(parser, loopStart);
 
     if (exitJump != -1)
     {
-        patchJump(exitJump);
-        emitByte(OP_POP); // Pop condition
+        patchJump(parser, exitJump);
+        if (!fused) emitByte(parser, OP_POP); // Pop condition
     }
 
-    endScope();
+    endScope(parser);
+}
+
+static void ifStatement(Parser* parser)
+{
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    bool fused;
+    int thenJump = emitConditionJump(parser, &fused);
+    statement(parser);
+
+    int elseJump = emitJump(parser, OP_JUMP);
+
+    patchJump(parser, thenJump);
+    if (!fused) emitByte(parser, OP_POP);
+
+    if (match(parser, TOKEN_ELSE)) statement(parser);
+    patchJump(parser, elseJump);
 }
 
-static void ifStatement()
+/*
+ * Resolves the path in the string token of an import against the directory
+ * of the importing file 'from' (or the working directory in the repl), so
+ * the vm only ever sees full paths.
+ */
+static char* resolveImport(const char* from, Token* string, int* resolvedLength)
 {
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+    const char* name = string->lexeme_start + 1;     // + 1 to remove '"'
+    int length = string->lexeme_length - 2;
 
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    statement();
+    int dirLength = 0;
+    if (from != NULL && length > 0 && name[0] != '/')
+    {
+        const char* slash = strrchr(from, '/');
+        if (slash != NULL) dirLength = (int)(slash - from) + 1;
+    }
 
-    int elseJump = emitJump(OP_JUMP);
+    char* path = ALLOCATE(char, dirLength + length + 1);
+    if (dirLength > 0) memcpy(path, from, dirLength);
+    memcpy(path + dirLength, name, length);
+    path[dirLength + length] = '\0';
 
-    patchJump(thenJump);
-    emitByte(OP_POP);
+    *resolvedLength = dirLength + length;
+    return path;
+}
+
+static void importStatement(Parser* parser)
+{
+    consume(parser, TOKEN_STRING, "Expect module path after 'import'.");
+    int length;
+    char* path = resolveImport(parser->path, &parser->previous, &length);
 
-    if (match(TOKEN_ELSE)) statement();
-    patchJump(elseJump);
+    emitConstantOp(parser, OP_IMPORT, OP_IMPORT_LONG, makeConstant(parser, OBJ_VAL(takeString(path, length))));
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after import.");
+    emitByte(parser, OP_POP); // Pop the module's return value
 }
 
-static void printStatement()
+static void printStatement(Parser* parser)
 {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-    emitByte(OP_PRINT);
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+    emitByte(parser, OP_PRINT);
 }
 
-static void returnStatement()
+static void returnStatement(Parser* parser)
 {
-    if (current->functionType == TYPE_SCRIPT)
+    if (parser->compiler->functionType == TYPE_SCRIPT)
     {
-        error("Can't return from top-level code.");
+        error(parser, "Can't return from top-level code.");
     }
 
-    if (match(TOKEN_SEMICOLON))
+    if (match(parser, TOKEN_SEMICOLON))
     {
-        emitReturn();
+        emitReturn(parser);
     }
     else {
-        if (current->functionType == TYPE_INITIALIZER)
+        if (parser->compiler->functionType == TYPE_INITIALIZER)
         {
-            error("Can't return a value from an initializer.");
+            error(parser, "Can't return a value from an initializer.");
         }
-        expression();
-        consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-        emitByte(OP_RETURN);
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+        emitByte(parser, OP_RETURN);
     }
 }
 
-static void whileStatement()
+static void whileStatement(Parser* parser)
 {
-    int loopStart = currentChunk()->count;
+    int loopStart = currentChunk(parser)->count;
 
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    statement();
-    emitLoop(loopStart);
+    bool fused;
+    int exitJump = emitConditionJump(parser, &fused);
+    statement(parser);
+    emitLoop(parser, loopStart);
 
-    patchJump(exitJump);
-    emitByte(OP_POP);
+    patchJump(parser, exitJump);
+    if (!fused) emitByte(parser, OP_POP);
 }
 
-static void synchronize()
+static void synchronize(Parser* parser)
 {
-    parser.panicMode = false;
+    parser->panicMode = false;
 
-    while (parser.current.type != TOKEN_EOF)
+    while (parser->current.type != TOKEN_EOF)
     {
-        if (parser.previous.type == TOKEN_SEMICOLON) return;
-        switch(parser.current.type)
+        if (parser->previous.type == TOKEN_SEMICOLON) return;
+        switch(parser->current.type)
         {
             case TOKEN_CLASS:
             case TOKEN_FUN:
             case TOKEN_VAR:
             case TOKEN_FOR:
             case TOKEN_IF:
+            case TOKEN_IMPORT:
             case TOKEN_WHILE:
             case TOKEN_PRINT:
             case TOKEN_RETURN:
@@ -1049,77 +1552,169 @@ static void synchronize()
             default:
                 ; // Do nothing.
         }
-        advance();
+        advance(parser);
     }
 }
 
-static void declaration()
+static void declaration(Parser* parser)
 {
-    if (match(TOKEN_CLASS)) classDeclaration();
-    else if (match(TOKEN_FUN)) funDeclaration();
-    else if (match(TOKEN_VAR)) varDeclaration();
-    else statement();
+    emitJumpIsland(parser);
 
-    if (parser.panicMode) synchronize();
+    if (match(parser, TOKEN_CLASS)) classDeclaration(parser);
+    else if (match(parser, TOKEN_FUN)) funDeclaration(parser);
+    else if (match(parser, TOKEN_VAR)) varDeclaration(parser);
+    else statement(parser);
+
+    if (parser->panicMode) synchronize(parser);
 }
 
-static void statement()
+static void statement(Parser* parser)
 {
-    if (match(TOKEN_PRINT)) 
+    if (match(parser, TOKEN_PRINT)) 
+    {
+        printStatement(parser);
+    }
+    else if (match(parser, TOKEN_FOR))
     {
-        printStatement();
+        forStatement(parser);
     }
-    else if (match(TOKEN_FOR))
+    else if (match(parser, TOKEN_IF))
     {
-        forStatement();
+        ifStatement(parser);
     }
-    else if (match(TOKEN_IF))
+    else if (match(parser, TOKEN_IMPORT))
     {
-        ifStatement();
+        importStatement(parser);
     }
-    else if (match(TOKEN_RETURN))
+    else if (match(parser, TOKEN_RETURN))
     {
-        returnStatement();
+        returnStatement(parser);
     }
-    else if (match(TOKEN_WHILE))
+    else if (match(parser, TOKEN_WHILE))
     {
-        whileStatement();
+        whileStatement(parser);
     }
-    else if (match(TOKEN_LEFT_BRACE))
+    else if (match(parser, TOKEN_LEFT_BRACE))
     {
-        beginScope();
-        block();
-        endScope();
+        beginScope(parser);
+        block(parser);
+        endScope(parser);
     }
-    else expressionStatement();
+    else expressionStatement(parser);
 }
 
-ObjFunction* compile(const char* source)
+static void initParser(Parser* parser, const char* source, int line, const char* path)
 {
-    initScanner(source);
-    Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT);
+    initScanner(&parser->scanner, source, line);
+    parser->hadError = false;
+    parser->panicMode = false;
+    parser->path = path;
+    parser->compiler = NULL;
+    parser->currentClass = NULL;
+    initArena(&parser->arena);
 
-    parser.hadError = false;
-    parser.panicMode = false;
+    // Nothing is collected while the vm's thread compiles, so the functions
+    // and names it's working on needn't be roots. Compiles on other
+    // threads allocate on a local heap, which is never collected anyway.
+    if (localHeap == NULL)
+    {
+        parser->gcWasPaused = vm.gcPaused;
+        vm.gcPaused = true;
+    }
+}
 
-    advance();
+static void endParser(Parser* parser)
+{
+    freeArena(&parser->arena);
+    if (localHeap == NULL) vm.gcPaused = parser->gcWasPaused;
+}
 
-    while (!match(TOKEN_EOF))
+ObjFunction* compile(const char* source, const char* path)
+{
+    Parser parser;
+    initParser(&parser, source, 1, path);
+    Compiler compiler;
+    initCompiler(&parser, &compiler, NULL, TYPE_SCRIPT);
+
+    advance(&parser);
+
+    while (!match(&parser, TOKEN_EOF))
     {
-        declaration();
+        declaration(&parser);
     }
 
-    ObjFunction* function = endCompiler();
+    ObjFunction* function = endCompiler(&parser);
+    endParser(&parser);
     return parser.hadError ? NULL : function;
 }
 
-void markCompilerRoots()
+/*
+ * Compiles the body of a lazily declared function, which the vm does on
+ * its first call. Compile errors are reported as usual and leave the
+ * function uncompiled.
+ */
+bool compileLazyBody(ObjFunction* function)
 {
-    Compiler* compiler = current;
-    while (compiler != NULL)
+    LazyBody* body = function->lazyBody;
+    int arity = function->arity;
+
+    Parser parser;
+    initParser(&parser, body->source, body->line, body->path);
+
+    ClassCompiler classCompiler;
+    classCompiler.enclosing = NULL;
+    classCompiler.hasSuperClass = body->hasSuperClass;
+    parser.currentClass = body->inClass ? &classCompiler : NULL;
+
+    Compiler compiler;
+    initCompiler(&parser, &compiler, function, body->functionType);
+    compiler.capturedNames = body->upvalueNames;
+    function->arity = 0;
+
+    advance(&parser);
+    functionBody(&parser);
+    endCompiler(&parser);
+    endParser(&parser);
+
+    if (parser.hadError)
     {
-        markObject((Obj*)compiler->function);
-        compiler = compiler->enclosing;
+        freeChunk(&function->chunk);
+        function->arity = arity;
+        return false;
     }
+
+    freeLazyBody(function);
+    return true;
+}
+
+/*
+ * Returns the next module imported by the source 'scanner' is on, resolved
+ * like compiling it would, or NULL at the end of the source. Only looks at
+ * tokens, so it also finds imports that never get run.
+ */
+char* nextImport(Scanner* scanner, const char* path)
+{
+    TokenType previous = TOKEN_EOF;
+    while (1)
+    {
+        Token token = scanToken(scanner);
+        if (token.type == TOKEN_EOF) return NULL;
+
+        if (previous == TOKEN_IMPORT && token.type == TOKEN_STRING)
+        {
+            int length;
+            return resolveImport(path, &token, &length);
+        }
+        previous = token.type;
+    }
+}
+
+void freeLazyBody(ObjFunction* function)
+{
+    LazyBody* body = function->lazyBody;
+    if (body == NULL) return;
+
+    FREE_ARRAY(Token, body->upvalueNames, function->upvalueCount);
+    FREE(LazyBody, body);
+    function->lazyBody = NULL;
 }
@@ -3,8 +3,11 @@
 
 #include "chunk.h"
 #include "object.h"
+#include "scanner.h"
 
-ObjFunction* compile(const char* source);
-void markCompilerRoots();
+ObjFunction* compile(const char* source, const char* path);
+bool compileLazyBody(ObjFunction* function);
+char* nextImport(Scanner* scanner, const char* path);
+void freeLazyBody(ObjFunction* function);
 
 #endif
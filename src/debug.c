@@ -17,6 +17,21 @@ void disassembleChunk(Chunk* chunk, const char* name)
     }
 }
 
+static int readUint16(Chunk* chunk, int offset)
+{
+    return (chunk->code[offset] << 8) | chunk->code[offset + 1];
+}
+
+static int readUint24(Chunk* chunk, int offset)
+{
+    return (chunk->code[offset] << 16) | readUint16(chunk, offset + 1);
+}
+
+static uint32_t readUint32(Chunk* chunk, int offset)
+{
+    return ((uint32_t)chunk->code[offset] << 24) | (uint32_t)readUint24(chunk, offset + 1);
+}
+
 static int constantInstruction(const char* name, Chunk* chunk, int offset)
 {
     uint8_t constant = chunk->code[offset + 1];
@@ -26,6 +41,15 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset)
     return offset + 2;
 }
 
+static int constantLongInstruction(const char* name, Chunk* chunk, int offset)
+{
+    int constant = readUint24(chunk, offset + 1);
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 4;
+}
+
 static int invokeInstruction(const char* name, Chunk* chunk, int offset)
 {
     uint8_t constant = chunk->code[offset + 1];
@@ -36,6 +60,16 @@ static int invokeInstruction(const char* name, Chunk* chunk, int offset)
     return offset + 3;
 }
 
+static int invokeLongInstruction(const char* name, Chunk* chunk, int offset)
+{
+    int constant = readUint24(chunk, offset + 1);
+    uint8_t argCount = chunk->code[offset + 4];
+    printf("%-16s (%d args) %4d '", name, argCount, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 5;
+}
+
 int simpleInstruction(const char* name, int offset)
 {
     printf("%s\n", name);
@@ -49,6 +83,12 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset)
     return offset + 2;
 }
 
+static int shortInstruction(const char* name, Chunk* chunk, int offset)
+{
+    printf("%-16s %4d\n", name, readUint16(chunk, offset + 1));
+    return offset + 3;
+}
+
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
 {
     uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
@@ -57,20 +97,48 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
     return offset + 3;
 }
 
+static int jumpLongInstruction(const char* name, int sign, Chunk* chunk, int offset)
+{
+    uint32_t jump = readUint32(chunk, offset + 1);
+    printf("%-16s %4d -> %lld\n", name, offset, offset + 5 + sign * (long long)jump);
+    return offset + 5;
+}
+
+static int closureInstruction(const char* name, Chunk* chunk, int offset, bool isLong)
+{
+    int constant = isLong ? readUint24(chunk, offset + 1) : chunk->code[offset + 1];
+    offset += isLong ? 4 : 2;
+    printf("%-16s %4d ", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("\n");
+
+    ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+    for (int j = 0; j < function->upvalueCount; j++)
+    {
+        int isLocal = chunk->code[offset];
+        int index = readUint16(chunk, offset + 1);
+        printf("%04d    |                     %s %d\n",
+            offset, isLocal ? "local" : "upvalue", index);
+        offset += 3;
+    }
+    return offset;
+}
+
 int disassembleInstruction(Chunk* chunk, int offset)
 {
     // print opcode offset
     printf("%04d ", offset);
 
     // source code line nrs
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset -1])
+    int line = getLine(chunk, offset);
+    if (offset > 0 && line == getLine(chunk, offset - 1))
     {
         // source code line nr is same as previous opcode; print '|'
         printf("   |  ");
     }
     else {
         // print source code line nr
-        printf("%4d  ", chunk->lines[offset]);
+        printf("%4d  ", line);
     }
 
     // print actual instructions
@@ -82,30 +150,22 @@ int disassembleInstruction(Chunk* chunk, int offset)
             return byteInstruction("OP_CALL", chunk, offset);
         case OP_CLASS:
             return constantInstruction("OP_CLASS", chunk, offset);
+        case OP_CLASS_LONG:
+            return constantLongInstruction("OP_CLASS_LONG", chunk, offset);
         case OP_CLOSE_UPVALUE:
             return simpleInstruction("OP_CLOSE_UPVALUE", offset);
         case OP_CLOSURE:
-        {
-            offset++;
-            uint8_t constant = chunk->code[offset++];
-            printf("%-16s %4d ", "OP_CLOSURE", constant);
-            printValue(chunk->constants.values[constant]);
-            printf("\n");
-
-            ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
-            for (int j = 0; j < function->upvalueCount; j++)
-            {
-                int isLocal = chunk->code[offset++];
-                int index = chunk->code[offset++];
-                printf("%04d    |                     %s %d\n",
-                    offset - 2, isLocal ? "local" : "upvalue", index);
-            }
-            return offset;
-        }
+            return closureInstruction("OP_CLOSURE", chunk, offset, false);
+        case OP_CLOSURE_LONG:
+            return closureInstruction("OP_CLOSURE_LONG", chunk, offset, true);
         case OP_CONSTANT:
             return constantInstruction("OP_CONSTANT", chunk, offset);
+        case OP_CONSTANT_LONG:
+            return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
         case OP_DEFINE_GLOBAL:
             return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+        case OP_DEFINE_GLOBAL_LONG:
+            return constantLongInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
         case OP_DIVIDE:
             return simpleInstruction("OP_DIVIDE", offset);
         case OP_EQUAL:
@@ -114,30 +174,62 @@ int disassembleInstruction(Chunk* chunk, int offset)
             return simpleInstruction("OP_FALSE", offset);
         case OP_GET_GLOBAL:
             return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+        case OP_GET_GLOBAL_LONG:
+            return constantLongInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
         case OP_GET_LOCAL:
             return byteInstruction("OP_GET_LOCAL", chunk, offset);
+        case OP_GET_LOCAL_LONG:
+            return shortInstruction("OP_GET_LOCAL_LONG", chunk, offset);
         case OP_GET_PROPERTY:
           return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+        case OP_GET_PROPERTY_LONG:
+          return constantLongInstruction("OP_GET_PROPERTY_LONG", chunk, offset);
         case OP_GET_SUPER:
             return constantInstruction("OP_GET_SUPER", chunk, offset);
+        case OP_GET_SUPER_LONG:
+            return constantLongInstruction("OP_GET_SUPER_LONG", chunk, offset);
         case OP_GET_UPVALUE:
             return byteInstruction("OP_GET_UPVALUE", chunk, offset);
         case OP_GREATER:
             return simpleInstruction("OP_GREATER", offset);
+        case OP_IMPORT:
+            return constantInstruction("OP_IMPORT", chunk, offset);
+        case OP_IMPORT_LONG:
+            return constantLongInstruction("OP_IMPORT_LONG", chunk, offset);
         case OP_INHERIT:
             return simpleInstruction("OP_INHERIT", offset);
         case OP_INVOKE:
             return invokeInstruction("OP_INVOKE", chunk, offset);
+        case OP_INVOKE_LONG:
+            return invokeLongInstruction("OP_INVOKE_LONG", chunk, offset);
         case OP_JUMP:
             return jumpInstruction("OP_JUMP", 1, chunk, offset);
+        case OP_JUMP_LONG:
+            return jumpLongInstruction("OP_JUMP_LONG", 1, chunk, offset);
+        case OP_JUMP_IF_EQUAL:
+            return jumpInstruction("OP_JUMP_IF_EQUAL", 1, chunk, offset);
         case OP_JUMP_IF_FALSE:
             return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_JUMP_IF_GREATER:
+            return jumpInstruction("OP_JUMP_IF_GREATER", 1, chunk, offset);
+        case OP_JUMP_IF_LESS:
+            return jumpInstruction("OP_JUMP_IF_LESS", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_EQUAL:
+            return jumpInstruction("OP_JUMP_IF_NOT_EQUAL", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_GREATER:
+            return jumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_LESS:
+            return jumpInstruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
         case OP_LESS:
             return simpleInstruction("OP_LESS", offset);
         case OP_LOOP:
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
+        case OP_LOOP_LONG:
+            return jumpLongInstruction("OP_LOOP_LONG", -1, chunk, offset);
         case OP_METHOD:
             return constantInstruction("OP_METHOD", chunk, offset);
+        case OP_METHOD_LONG:
+            return constantLongInstruction("OP_METHOD_LONG", chunk, offset);
         case OP_MULTIPLY:
             return simpleInstruction("OP_MULTIPLY", offset);
         case OP_NEGATE:
@@ -154,16 +246,24 @@ int disassembleInstruction(Chunk* chunk, int offset)
             return simpleInstruction("OP_RETURN", offset);
         case OP_SET_GLOBAL:
             return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+        case OP_SET_GLOBAL_LONG:
+            return constantLongInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
         case OP_SET_LOCAL:
             return byteInstruction("OP_SET_LOCAL", chunk, offset);
+        case OP_SET_LOCAL_LONG:
+            return shortInstruction("OP_SET_LOCAL_LONG", chunk, offset);
         case OP_SET_PROPERTY:
           return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+        case OP_SET_PROPERTY_LONG:
+          return constantLongInstruction("OP_SET_PROPERTY_LONG", chunk, offset);
         case OP_SET_UPVALUE:
             return byteInstruction("OP_SET_UPVALUE", chunk, offset);
         case OP_SUBTRACT:
             return simpleInstruction("OP_SUBTRACT", offset);
         case OP_SUPER_INVOKE:
             return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+        case OP_SUPER_INVOKE_LONG:
+            return invokeLongInstruction("OP_SUPER_INVOKE_LONG", chunk, offset);
         case OP_TRUE:
             return simpleInstruction("OP_TRUE", offset);
         default:
@@ -0,0 +1,191 @@
+// For clock_gettime(), which -std=c11 leaves out.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "gcstats.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+// By ObjType.
+static const char* typeNames[OBJ_TYPE_COUNT] =
+{
+    "boundMethods", "classes", "closures", "functions",
+    "instances", "natives", "strings", "upvalues",
+};
+
+// Spelled out, since identifiers can't have digits.
+static const char* bucketNames[GC_PAUSE_BUCKETS] =
+{
+    "pausesUnderTenMicros", "pausesUnderHundredMicros", "pausesUnderOneMilli",
+    "pausesUnderTenMillis", "pausesUnderHundredMillis", "pausesLonger",
+};
+
+double nowMicros()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+/*
+ * Time spent in pauses so far, the one in progress included.
+ */
+double gcMicros()
+{
+    double micros = vm.gcStats.pauseTotal;
+    if (vm.gcStats.pauseDepth > 0) micros += nowMicros() - vm.gcStats.pauseStart;
+    return micros;
+}
+
+void beginGcPause()
+{
+    if (vm.gcStats.pauseDepth++ == 0) vm.gcStats.pauseStart = nowMicros();
+}
+
+void endGcPause()
+{
+    GcStats* stats = &vm.gcStats;
+    if (--stats->pauseDepth > 0) return;
+
+    double micros = nowMicros() - stats->pauseStart;
+    int bucket = 0;
+    for (double limit = 10; bucket < GC_PAUSE_BUCKETS - 1 && micros >= limit; limit *= 10) bucket++;
+
+    stats->pauses++;
+    stats->pauseBuckets[bucket]++;
+    stats->pauseTotal += micros;
+    if (micros > stats->pauseMax) stats->pauseMax = micros;
+}
+
+/*
+ * Called once a cycle is over and vm.nextGC is set for the next one.
+ */
+void recordCycle()
+{
+    GcStats* stats = &vm.gcStats;
+    stats->collections++;
+    stats->cycleAllocated = stats->bytesAllocated - stats->allocatedAtCycle;
+    stats->cycleFreed = stats->bytesFreed - stats->freedAtCycle;
+    stats->allocatedAtCycle = stats->bytesAllocated;
+    stats->freedAtCycle = stats->bytesFreed;
+    stats->nextGCHistory[stats->nextGCCount++ % GC_HISTORY] = vm.nextGC;
+}
+
+/*
+ * The counters so far, along with a count of the objects on the heap.
+ * Those include garbage the collector hasn't found yet.
+ */
+GcStats gcStatistics()
+{
+    GcStats stats = vm.gcStats;
+    countObjects(stats.objects);
+    return stats;
+}
+
+/*
+ * The thresholds in the history, oldest first, separated by spaces.
+ */
+static void formatHistory(GcStats* stats, char* buffer, size_t size)
+{
+    size_t start = stats->nextGCCount > GC_HISTORY ? stats->nextGCCount - GC_HISTORY : 0;
+    size_t length = 0;
+    buffer[0] = '\0';
+    for (size_t i = start; i < stats->nextGCCount && length < size; i++)
+    {
+        length += snprintf(buffer + length, size - length, i > start ? " %zu" : "%zu",
+                           stats->nextGCHistory[i % GC_HISTORY]);
+    }
+}
+
+static void setField(ObjInstance* instance, const char* name, Value value)
+{
+    pushRoot(value);
+    ObjString* key = copyString(name, (int)strlen(name));
+    pushRoot(OBJ_VAL(key));
+    tableSet(&instance->fields, key, value);
+    writeBarrier((Obj*)instance, OBJ_VAL(key));
+    writeBarrier((Obj*)instance, value);
+    popRoot();
+    popRoot();
+}
+
+/*
+ * The statistics as an instance of a class GcStats, with a field per
+ * counter, for the gcStats() native.
+ */
+ObjInstance* newGcStatsInstance()
+{
+    GcStats stats = gcStatistics();
+    size_t bytesInUse = vm.bytesAllocated;
+    size_t nextGC = vm.nextGC;
+    size_t heapGoal = vm.pacer.goal;
+    char history[GC_HISTORY * 24];
+    formatHistory(&stats, history, sizeof(history));
+
+    ObjString* name = copyString("GcStats", 7);
+    pushRoot(OBJ_VAL(name));
+    ObjClass* klass = newClass(name);
+    popRoot();
+    pushRoot(OBJ_VAL(klass));
+    ObjInstance* instance = newInstance(klass);
+    popRoot();
+    pushRoot(OBJ_VAL(instance));
+
+    setField(instance, "collections", NUMBER_VAL((double)stats.collections));
+    setField(instance, "minorCollections", NUMBER_VAL((double)stats.minorCollections));
+    setField(instance, "compactions", NUMBER_VAL((double)stats.compactions));
+    setField(instance, "pauses", NUMBER_VAL((double)stats.pauses));
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++)
+    {
+        setField(instance, bucketNames[i], NUMBER_VAL((double)stats.pauseBuckets[i]));
+    }
+    setField(instance, "pauseTotalMicros", NUMBER_VAL(stats.pauseTotal));
+    setField(instance, "pauseMaxMicros", NUMBER_VAL(stats.pauseMax));
+    setField(instance, "bytesAllocated", NUMBER_VAL((double)stats.bytesAllocated));
+    setField(instance, "bytesFreed", NUMBER_VAL((double)stats.bytesFreed));
+    setField(instance, "cycleBytesAllocated", NUMBER_VAL((double)stats.cycleAllocated));
+    setField(instance, "cycleBytesFreed", NUMBER_VAL((double)stats.cycleFreed));
+    setField(instance, "bytesInUse", NUMBER_VAL((double)bytesInUse));
+    setField(instance, "nextGC", NUMBER_VAL((double)nextGC));
+    setField(instance, "heapGoal", NUMBER_VAL((double)heapGoal));
+    setField(instance, "nextGCHistory", OBJ_VAL(copyString(history, (int)strlen(history))));
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++)
+    {
+        setField(instance, typeNames[i], NUMBER_VAL((double)stats.objects[i]));
+    }
+
+    popRoot();
+    return instance;
+}
+
+void printGcStats(FILE* out)
+{
+    GcStats stats = gcStatistics();
+    char history[GC_HISTORY * 24];
+    formatHistory(&stats, history, sizeof(history));
+
+    fprintf(out, "-- gc stats\n");
+    fprintf(out, "collections        %zu full, %zu minor, %zu compactions\n",
+            stats.collections, stats.minorCollections, stats.compactions);
+    fprintf(out, "pauses             %zu, %.0fus in total, %.0fus at most\n",
+            stats.pauses, stats.pauseTotal, stats.pauseMax);
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++)
+    {
+        fprintf(out, "  %-25s%zu\n", bucketNames[i], stats.pauseBuckets[i]);
+    }
+    fprintf(out, "bytes allocated    %zu, %zu in the last cycle\n", stats.bytesAllocated, stats.cycleAllocated);
+    fprintf(out, "bytes freed        %zu, %zu in the last cycle\n", stats.bytesFreed, stats.cycleFreed);
+    fprintf(out, "bytes in use       %zu, next collection at %zu, goal %zu\n",
+            vm.bytesAllocated, vm.nextGC, vm.pacer.goal);
+    fprintf(out, "next gc history    %s\n", history);
+    fprintf(out, "objects\n");
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++)
+    {
+        fprintf(out, "  %-25s%zu\n", typeNames[i], stats.objects[i]);
+    }
+}
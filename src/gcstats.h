@@ -0,0 +1,50 @@
+#ifndef clox_gcstats_h
+#define clox_gcstats_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+
+#define OBJ_TYPE_COUNT (OBJ_UPVALUE + 1)
+
+// Pauses are counted in buckets of under 10us, 100us, 1ms, 10ms, 100ms
+// and longer.
+#define GC_PAUSE_BUCKETS 6
+#define GC_HISTORY 16
+
+// What the collector did since the vm started. A pause is any stretch of
+// collector work the program waits on: a full collection, a slice, a
+// minor collection or a gcStep() call.
+typedef struct
+{
+	size_t collections;					// Full cycles finished
+	size_t minorCollections;
+	size_t compactions;
+	size_t pauses;
+	size_t pauseBuckets[GC_PAUSE_BUCKETS];
+	double pauseTotal;					// In microseconds
+	double pauseMax;					// Likewise
+	size_t bytesAllocated;				// On the vm's heap, arrays included
+	size_t bytesFreed;
+	size_t cycleAllocated;				// Between the ends of the last two cycles
+	size_t cycleFreed;					// Likewise
+	size_t allocatedAtCycle;			// bytesAllocated when the last cycle ended
+	size_t freedAtCycle;				// bytesFreed when the last cycle ended
+	size_t nextGCHistory[GC_HISTORY];	// Thresholds the last cycles set, as a ring
+	size_t nextGCCount;					// Thresholds set so far
+	size_t objects[OBJ_TYPE_COUNT];		// Objects on the heap by type, see gcStatistics()
+	int pauseDepth;						// Pauses in progress, nested ones included
+	double pauseStart;					// When the outermost one started
+} GcStats;
+
+double nowMicros();
+double gcMicros();
+void beginGcPause();
+void endGcPause();
+void recordCycle();
+GcStats gcStatistics();
+ObjInstance* newGcStatsInstance();
+void printGcStats(FILE* out);
+
+#endif
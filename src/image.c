@@ -0,0 +1,392 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "chunk.h"
+#include "common.h"
+#include "compiler.h"
+#include "image.h"
+#include "memory.h"
+#include "object.h"
+#include "serial.h"
+#include "value.h"
+#include "vm.h"
+
+// A compiled script is cached next to its source as a versioned binary
+// image. Bump IMAGE_VERSION whenever the layout below or the meaning of
+// any opcode changes, so stale caches get recompiled instead of run.
+#define IMAGE_MAGIC "LOXC"
+#define IMAGE_VERSION 5
+#define IMAGE_BYTE_ORDER 0x01020304u
+
+typedef enum
+{
+    CONST_NIL,
+    CONST_FALSE,
+    CONST_TRUE,
+    CONST_NUMBER,
+    CONST_STRING,
+    CONST_FUNCTION,
+} ConstantTag;
+
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t byteOrder;     // IMAGE_BYTE_ORDER as written by the host
+    uint32_t checksum;      // of everything after the header, see checksumBytes()
+    uint64_t sourceHash;    // hash of the source and path the image was compiled from
+} ImageHeader;
+
+// Images stay mapped for the lifetime of the vm, since the chunks loaded
+// from them point straight into the mapping instead of owning a copy.
+typedef struct Image
+{
+    struct Image* next;
+    void* start;
+    size_t size;
+} Image;
+
+// Modules compiled ahead of time load their images on other threads.
+static pthread_mutex_t imagesLock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t hashChars(uint64_t hash, const char* chars)
+{
+    for (const char* c = chars; *c != '\0'; c++)
+    {
+        hash ^= (uint8_t)*c;
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+uint64_t hashSource(const char* source)
+{
+    return hashChars(14695981039346656037u, source);
+}
+
+/*
+ * "foo.lox" is cached as "foo.loxc", anything else gets ".loxc" appended.
+ */
+static char* cachePathFor(const char* path)
+{
+    size_t length = strlen(path);
+    char* cachePath = (char*)malloc(length + 6);
+    if (cachePath == NULL) return NULL;
+
+    memcpy(cachePath, path, length + 1);
+    if (length >= 4 && strcmp(path + length - 4, ".lox") == 0)
+    {
+        strcpy(cachePath + length, "c");
+    }
+    else
+    {
+        strcpy(cachePath + length, ".loxc");
+    }
+    return cachePath;
+}
+
+static void writeString(Writer* writer, ObjString* string)
+{
+    writeU32(writer, (uint32_t)string->length);
+    writeBytes(writer, string->chars, string->length);
+}
+
+static void writeFunction(Writer* writer, ObjFunction* function);
+
+static void writeConstant(Writer* writer, Value value)
+{
+    if (IS_NIL(value))
+    {
+        writeU8(writer, CONST_NIL);
+    }
+    else if (IS_BOOL(value))
+    {
+        writeU8(writer, AS_BOOL(value) ? CONST_TRUE : CONST_FALSE);
+    }
+    else if (IS_NUMBER(value))
+    {
+        writeU8(writer, CONST_NUMBER);
+        writeF64(writer, AS_NUMBER(value));
+    }
+    else if (IS_STRING(value))
+    {
+        writeU8(writer, CONST_STRING);
+        writeString(writer, AS_STRING(value));
+    }
+    else if (IS_FUNCTION(value))
+    {
+        writeU8(writer, CONST_FUNCTION);
+        writeFunction(writer, AS_FUNCTION(value));
+    }
+    else
+    {
+        // The compiler never puts other objects in a constant table.
+        writer->failed = true;
+    }
+}
+
+static void writeFunction(Writer* writer, ObjFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+
+    // A lazily compiled script isn't complete until every body has run.
+    if (function->lazyBody != NULL) writer->failed = true;
+
+    writeU32(writer, (uint32_t)function->arity);
+    writeU32(writer, (uint32_t)function->upvalueCount);
+    writeU32(writer, (uint32_t)function->stackSlots);
+    writeU8(writer, function->name != NULL);
+    if (function->name != NULL) writeString(writer, function->name);
+
+    writeU32(writer, (uint32_t)chunk->count);
+    writeBytes(writer, chunk->code, chunk->count);
+    writeU32(writer, (uint32_t)chunk->lineCount);
+    writeAlign(writer, sizeof(int));
+    writeBytes(writer, chunk->lines, sizeof(LineStart) * chunk->lineCount);
+
+    writeU32(writer, (uint32_t)chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++)
+    {
+        writeConstant(writer, chunk->constants.values[i]);
+    }
+}
+
+static void writeImage(const char* cachePath, ObjFunction* function, uint64_t hash)
+{
+    // Write to a private temp file and rename it into place, so other
+    // processes never map a half-written image.
+    size_t length = strlen(cachePath);
+    char* tempPath = (char*)malloc(length + 32);
+    if (tempPath == NULL) return;
+    snprintf(tempPath, length + 32, "%s.%ld.tmp", cachePath, (long)getpid());
+
+    Writer writer;
+    initWriter(&writer, fopen(tempPath, "wb"));
+    if (writer.failed)
+    {
+        free(tempPath);
+        return;
+    }
+
+    ImageHeader header;
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.byteOrder = IMAGE_BYTE_ORDER;
+    header.checksum = 0;
+    header.sourceHash = hash;
+    writeBytes(&writer, &header, sizeof(header));
+    writer.checksum = CHECKSUM_START;
+    writeFunction(&writer, function);
+
+    // The checksum is only known once the rest is written.
+    header.checksum = writer.checksum;
+    if (fseek(writer.file, 0, SEEK_SET) != 0) writer.failed = true;
+    writeBytes(&writer, &header, sizeof(header));
+
+    if (fclose(writer.file) != 0) writer.failed = true;
+    if (writer.failed || rename(tempPath, cachePath) != 0) remove(tempPath);
+    free(tempPath);
+}
+
+static ObjString* readString(Reader* reader)
+{
+    uint32_t length = readU32(reader);
+    const uint8_t* chars = readBytes(reader, length);
+    if (chars == NULL || length > INT32_MAX) return NULL;
+    return copyString((const char*)chars, (int)length);
+}
+
+static ObjFunction* readFunction(Reader* reader);
+
+static bool readConstant(Reader* reader, Value* value)
+{
+    switch (readU8(reader))
+    {
+        case CONST_NIL:
+            *value = NIL_VAL;
+            break;
+        case CONST_FALSE:
+            *value = BOOL_VAL(false);
+            break;
+        case CONST_TRUE:
+            *value = BOOL_VAL(true);
+            break;
+        case CONST_NUMBER:
+            *value = NUMBER_VAL(readF64(reader));
+            break;
+        case CONST_STRING:
+        {
+            ObjString* string = readString(reader);
+            if (string == NULL) return false;
+            *value = OBJ_VAL(string);
+            break;
+        }
+        case CONST_FUNCTION:
+        {
+            ObjFunction* function = readFunction(reader);
+            if (function == NULL) return false;
+            *value = OBJ_VAL(function);
+            break;
+        }
+        default:
+            reader->failed = true;
+    }
+    return !reader->failed;
+}
+
+static ObjFunction* readFunction(Reader* reader)
+{
+    ObjFunction* function = newFunction();
+    pushRoot(OBJ_VAL(function)); // keep it reachable while its parts are allocated
+
+    uint32_t arity = readU32(reader);
+    uint32_t upvalueCount = readU32(reader);
+    uint32_t stackSlots = readU32(reader);
+    if (arity > UINT8_MAX || upvalueCount > UINT8_COUNT || stackSlots > UINT16_COUNT) reader->failed = true;
+    function->arity = (int)arity;
+    function->upvalueCount = (int)upvalueCount;
+    function->stackSlots = (int)stackSlots;
+    if (readU8(reader)) function->name = readString(reader);
+    if (function->name != NULL) writeBarrier((Obj*)function, OBJ_VAL(function->name));
+
+    // The bytecode and line numbers are borrowed from the mapping rather
+    // than copied; a chunk with zero capacity doesn't own its arrays.
+    Chunk* chunk = &function->chunk;
+    uint32_t count = readU32(reader);
+    const uint8_t* code = readBytes(reader, count);
+    uint32_t lineCount = readU32(reader);
+    readAlign(reader, sizeof(int));
+    const uint8_t* lines = readBytes(reader, sizeof(LineStart) * (size_t)lineCount);
+    if (!reader->failed && count <= INT32_MAX && lineCount <= count)
+    {
+        chunk->code = (uint8_t*)code;
+        chunk->count = (int)count;
+        chunk->lines = (LineStart*)lines;
+        chunk->lineCount = (int)lineCount;
+    }
+    else
+    {
+        reader->failed = true;
+    }
+
+    uint32_t constantCount = readU32(reader);
+    for (uint32_t i = 0; i < constantCount && !reader->failed; i++)
+    {
+        Value value;
+        if (!readConstant(reader, &value)) break;
+        pushRoot(value);
+        addConstant(chunk, value);
+        popRoot();
+        writeBarrier((Obj*)function, value);
+    }
+    shrinkValueArray(&chunk->constants);
+
+    popRoot();
+    if (reader->failed || !verifyCode(function))
+    {
+        reader->failed = true;
+        return NULL;
+    }
+    return function;
+}
+
+static ObjFunction* loadImage(const char* cachePath, uint64_t hash)
+{
+    int fd = open(cachePath, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(ImageHeader))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = (size_t)info.st_size;
+    void* start = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (start == MAP_FAILED) return NULL;
+
+    ImageHeader header;
+    memcpy(&header, start, sizeof(header));
+    if (memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != IMAGE_VERSION
+        || header.byteOrder != IMAGE_BYTE_ORDER
+        || header.sourceHash != hash
+        || header.checksum != checksumBytes(CHECKSUM_START, (const uint8_t*)start + sizeof(header),
+                                            size - sizeof(header)))
+    {
+        munmap(start, size);
+        return NULL;
+    }
+
+    Reader reader;
+    initReader(&reader, start, size);
+    readBytes(&reader, sizeof(header));
+
+    ObjFunction* function = readFunction(&reader);
+    if (function == NULL)
+    {
+        // Whatever was loaded is unreachable and never runs, so it's
+        // fine for its chunks to dangle once the mapping is gone.
+        munmap(start, size);
+        return NULL;
+    }
+
+    pushRoot(OBJ_VAL(function));
+    Image* image = ALLOCATE(Image, 1);
+    popRoot();
+    image->start = start;
+    image->size = size;
+    pthread_mutex_lock(&imagesLock);
+    image->next = vm.images;
+    vm.images = image;
+    pthread_mutex_unlock(&imagesLock);
+    return function;
+}
+
+/*
+ * Loads the compiled form of 'source' from the cache next to 'path' if
+ * it's still valid, otherwise compiles it and refreshes the cache. Just
+ * compiles when the cache is turned off.
+ */
+ObjFunction* compileCached(const char* path, const char* source)
+{
+    // Imports are resolved against the script's own path at compile time,
+    // so a cache is only valid for the path it was compiled at.
+    if (!vm.useImageCache) return compile(source, path);
+
+    uint64_t hash = hashChars(hashSource(source), path);
+    char* cachePath = cachePathFor(path);
+    if (cachePath == NULL) return compile(source, path);
+
+    ObjFunction* function = loadImage(cachePath, hash);
+    if (function == NULL)
+    {
+        function = compile(source, path);
+        if (function != NULL) writeImage(cachePath, function, hash);
+    }
+
+    free(cachePath);
+    return function;
+}
+
+void freeImages()
+{
+    Image* image = vm.images;
+    while (image != NULL)
+    {
+        Image* next = image->next;
+        munmap(image->start, image->size);
+        FREE(Image, image);
+        image = next;
+    }
+    vm.images = NULL;
+}
@@ -0,0 +1,11 @@
+#ifndef clox_image_h
+#define clox_image_h
+
+#include "common.h"
+#include "object.h"
+
+uint64_t hashSource(const char* source);
+ObjFunction* compileCached(const char* path, const char* source);
+void freeImages();
+
+#endif
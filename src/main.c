@@ -6,6 +6,9 @@
 #include "common.h"
 #include "debug.h"
 #include "exit_codes.h"
+#include "gcstats.h"
+#include "memory.h"
+#include "snapshot.h"
 #include "vm.h"
 
 static void repl()
@@ -59,32 +62,99 @@ static char* readFile(const char* path)
 	return buffer;
 }
 
-static void runFile(const char* path)
+static void runFile(const char* path, bool useCache, bool gcStats)
 {
 	char* source = readFile(path);
-	InterpretResult result = interpret(source);
+	vm.useImageCache = useCache;
+	InterpretResult result = interpretFile(path, source);
 	free(source);
 
+	if (gcStats) printGcStats(stderr);
+
 	if (result == INTERPRET_COMPILE_ERROR) exit(EX_DATAERR);
 	if (result == INTERPRET_RUNTIME_ERROR) exit(EX_SOFTWARE);
 }
 
+static void warnSoftLimit(size_t bytesInUse)
+{
+	fprintf(stderr, "Warning: %zu bytes in use, past the soft limit.\n", bytesInUse);
+}
+
+static void usage()
+{
+	fprintf(stderr, "Usage: clox [--no-cache] [--lazy] [--incremental-gc] [--gc-threads n] [--compact-gc] [--gc-stats] [--gc-overhead percent] [--heap-limit mb] [--soft-limit mb] [--hard-limit mb] [--snapshot-after-init image | --from-snapshot image] [path]\n");
+	exit(EX_USAGE);
+}
+
 int main(int argc, const char* argv[])
 {
+	const char* path = NULL;
+	bool useCache = true;
+	bool lazyCompile = false;
+	bool incrementalGC = false;
+	bool compactGC = false;
+	bool gcStats = false;
+	int gcOverhead = -1;
+	size_t heapLimit = 0;
+	size_t softLimit = 0;
+	size_t hardLimit = 0;
+	int markThreads = -1;
+	const char* snapshotOut = NULL;
+	const char* snapshotIn = NULL;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--no-cache") == 0) useCache = false;
+		else if (strcmp(argv[i], "--lazy") == 0) lazyCompile = true;
+		else if (strcmp(argv[i], "--incremental-gc") == 0) incrementalGC = true;
+		else if (strcmp(argv[i], "--compact-gc") == 0) compactGC = true;
+		else if (strcmp(argv[i], "--gc-stats") == 0) gcStats = true;
+		else if (strcmp(argv[i], "--gc-overhead") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) gcOverhead = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--heap-limit") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) heapLimit = (size_t)atoi(argv[++i]) * 1024 * 1024;
+		else if (strcmp(argv[i], "--soft-limit") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) softLimit = (size_t)atoi(argv[++i]) * 1024 * 1024;
+		else if (strcmp(argv[i], "--hard-limit") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) hardLimit = (size_t)atoi(argv[++i]) * 1024 * 1024;
+		else if (strcmp(argv[i], "--gc-threads") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) markThreads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--snapshot-after-init") == 0 && i + 1 < argc) snapshotOut = argv[++i];
+		else if (strcmp(argv[i], "--from-snapshot") == 0 && i + 1 < argc) snapshotIn = argv[++i];
+		else if (strncmp(argv[i], "--", 2) == 0 || path != NULL) usage();
+		else path = argv[i];
+	}
+
+	// A snapshot is taken once the script ran, and can't contain bodies
+	// that were never compiled.
+	if (snapshotOut != NULL && (path == NULL || lazyCompile || snapshotIn != NULL)) usage();
+
 	initVM();	
+	vm.incrementalGC = incrementalGC;
+	vm.compactGC = compactGC;
+	if (gcOverhead > 0) vm.pacer.overhead = gcOverhead;
+	vm.pacer.limit = heapLimit;
+	setMemoryBudget(softLimit, hardLimit, warnSoftLimit);
+	if (markThreads > 0) vm.markThreads = markThreads;
 
-	if (argc == 1)
+	if (snapshotIn != NULL && !loadSnapshot(snapshotIn))
 	{
-		repl(); // read-eval-print-loop
+		fprintf(stderr, "Could not load snapshot \"%s\".\n", snapshotIn);
+		exit(EX_DATAERR);
 	}
-	else if (argc == 2)
+
+	if (path == NULL)
 	{
-		runFile(argv[1]);
+		repl(); // read-eval-print-loop
+		if (gcStats) printGcStats(stderr);
 	}
 	else
 	{
-		fprintf(stderr, "Usage: clox [path]\n");
-		exit(EX_USAGE);
+		// Lazy bodies are compiled from the source later on, so this only
+		// works for files; the repl reuses its line buffer.
+		vm.lazyCompile = lazyCompile;
+		runFile(path, useCache, gcStats);
+	}
+
+	if (snapshotOut != NULL && !writeSnapshot(snapshotOut))
+	{
+		fprintf(stderr, "Could not write snapshot \"%s\".\n", snapshotOut);
+		exit(EX_IOERR);
 	}
 
 	freeVM();
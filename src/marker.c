@@ -0,0 +1,290 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "marker.h"
+#include "memory.h"
+#include "object.h"
+
+#define MAX_MARK_THREADS 32
+
+// Gray objects a thread keeps to itself before it shares half of them.
+#define LOCAL_GRAY_MAX 256
+
+// Every thread taking part in a parallel mark blackens the gray objects on
+// its own stack, and moves some of them to a deque other threads can steal
+// from whenever the stack grows or someone ran out of work. Mark bits are
+// set with an atomic or, so each object is blackened exactly once.
+// The vm's thread marks too, the others are kept around between marks.
+typedef struct
+{
+    Obj** objects;
+    int count;
+    int capacity;
+} GrayList;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    GrayList shared;            // Objects up for stealing, from 'start' on
+    int start;                  // Where thieves take from; the owner takes from the end
+    int available;              // shared.count - start, read without the lock
+    GrayList local;             // Objects only the owner touches
+    bool working;               // Set while a helper has a mark to do
+} Marker;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     // Signalled when a mark starts, a helper finishes or all stop
+    pthread_t threads[MAX_MARK_THREADS];
+    int threadCount;            // Helpers started so far
+    int active;                 // Threads taking part in the current mark
+    int running;                // Helpers that haven't finished the current mark
+    int idle;                   // Threads out of work, updated atomically
+    bool stopping;
+    bool initialized;
+    Marker markers[MAX_MARK_THREADS];
+} MarkPool;
+
+static MarkPool pool = {.lock = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER};
+
+_Thread_local bool markingInParallel = false;
+static _Thread_local Marker* marker = NULL;
+
+static void pushList(GrayList* list, Obj* object)
+{
+    if (list->capacity < list->count + 1)
+    {
+        list->capacity = NEW_ARRAY_CAPACITY(list->capacity);
+        list->objects = (Obj**)realloc(list->objects, sizeof(Obj*) * list->capacity);
+        if (list->objects == NULL) exit(1); // Realloc fail. Can't recover.
+    }
+    list->objects[list->count++] = object;
+}
+
+/*
+ * Moves the older half of the owner's stack to its deque.
+ */
+static void share(Marker* self)
+{
+    int half = (self->local.count + 1) / 2;
+
+    pthread_mutex_lock(&self->lock);
+    for (int i = 0; i < half; i++)
+    {
+        pushList(&self->shared, self->local.objects[i]);
+    }
+    __atomic_store_n(&self->available, self->shared.count - self->start, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&self->lock);
+
+    self->local.count -= half;
+    memmove(self->local.objects, self->local.objects + half, sizeof(Obj*) * self->local.count);
+}
+
+void markShared(Obj* object)
+{
+    size_t index;
+    uint64_t* bits = markBitmap(object, &index);
+    uint64_t bit = (uint64_t)1 << (index % 64);
+    if (__atomic_fetch_or(&bits[index / 64], bit, __ATOMIC_RELAXED) & bit) return;
+
+    pushList(&marker->local, object);
+    if (marker->local.count > LOCAL_GRAY_MAX
+        || (marker->local.count > 1 && __atomic_load_n(&pool.idle, __ATOMIC_RELAXED) > 0))
+    {
+        share(marker);
+    }
+}
+
+/*
+ * Takes objects off the deque of 'victim' onto our own stack: the newest
+ * one if it's ours, otherwise the older half. Returns false if it was
+ * empty.
+ */
+static bool takeShared(Marker* self, Marker* victim)
+{
+    if (__atomic_load_n(&victim->available, __ATOMIC_RELAXED) == 0) return false;
+
+    pthread_mutex_lock(&victim->lock);
+    int available = victim->shared.count - victim->start;
+    int taken = victim == self ? (available > 0) : (available + 1) / 2;
+    for (int i = 0; i < taken; i++)
+    {
+        Obj* object = victim == self ? victim->shared.objects[--victim->shared.count]
+                                     : victim->shared.objects[victim->start++];
+        pushList(&self->local, object);
+    }
+    if (victim->start == victim->shared.count)
+    {
+        victim->start = 0;
+        victim->shared.count = 0;
+    }
+    __atomic_store_n(&victim->available, victim->shared.count - victim->start, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&victim->lock);
+    return taken > 0;
+}
+
+static bool steal(Marker* self)
+{
+    int index = (int)(self - pool.markers);
+    for (int i = 1; i < pool.active; i++)
+    {
+        if (takeShared(self, &pool.markers[(index + i) % pool.active])) return true;
+    }
+    return false;
+}
+
+static bool workAvailable()
+{
+    for (int i = 0; i < pool.active; i++)
+    {
+        if (__atomic_load_n(&pool.markers[i].available, __ATOMIC_RELAXED) > 0) return true;
+    }
+    return false;
+}
+
+/*
+ * Blackens objects until every thread is out of work. Only the owner puts
+ * objects on its deque, so once all of them are idle at the same time,
+ * none of them can find more.
+ */
+static void drain(Marker* self)
+{
+    while (1)
+    {
+        while (self->local.count > 0 || takeShared(self, self))
+        {
+            blackenObject(self->local.objects[--self->local.count]);
+        }
+        if (steal(self)) continue;
+
+        __atomic_fetch_add(&pool.idle, 1, __ATOMIC_ACQ_REL);
+        while (1)
+        {
+            if (__atomic_load_n(&pool.idle, __ATOMIC_ACQUIRE) == pool.active) return;
+            if (workAvailable())
+            {
+                __atomic_fetch_sub(&pool.idle, 1, __ATOMIC_ACQ_REL);
+                break;
+            }
+            sched_yield();
+        }
+    }
+}
+
+static void markAsThread(Marker* self)
+{
+    marker = self;
+    markingInParallel = true;
+    drain(self);
+    markingInParallel = false;
+    marker = NULL;
+}
+
+static void* markThread(void* arg)
+{
+    Marker* self = (Marker*)arg;
+
+    pthread_mutex_lock(&pool.lock);
+    while (1)
+    {
+        while (!self->working && !pool.stopping) pthread_cond_wait(&pool.changed, &pool.lock);
+        if (pool.stopping) break;
+
+        pthread_mutex_unlock(&pool.lock);
+        markAsThread(self);
+        pthread_mutex_lock(&pool.lock);
+
+        self->working = false;
+        if (--pool.running == 0) pthread_cond_broadcast(&pool.changed);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+/*
+ * One thread per core, within reason.
+ */
+int defaultMarkThreads()
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus < 1 ? 1 : cpus > MAX_MARK_THREADS ? MAX_MARK_THREADS : (int)cpus;
+}
+
+/*
+ * Blackens everything reachable from the 'count' objects in 'gray', which
+ * are already marked, on up to 'threads' threads including this one.
+ */
+void markInParallel(Obj** gray, int count, int threads)
+{
+    if (threads > MAX_MARK_THREADS) threads = MAX_MARK_THREADS;
+
+    pthread_mutex_lock(&pool.lock);
+    if (!pool.initialized)
+    {
+        for (int i = 0; i < MAX_MARK_THREADS; i++)
+        {
+            pthread_mutex_init(&pool.markers[i].lock, NULL);
+        }
+        pool.initialized = true;
+    }
+
+    // Helpers are numbered from 1; the vm's thread marks as number 0.
+    while (pool.threadCount + 1 < threads)
+    {
+        Marker* helper = &pool.markers[pool.threadCount + 1];
+        if (pthread_create(&pool.threads[pool.threadCount], NULL, markThread, helper) != 0) break;
+        pool.threadCount++;
+    }
+    if (threads > pool.threadCount + 1) threads = pool.threadCount + 1;
+
+    for (int i = 0; i < count; i++)
+    {
+        pushList(&pool.markers[i % threads].shared, gray[i]);
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        Marker* each = &pool.markers[i];
+        each->available = each->shared.count - each->start;
+        each->working = i > 0;
+    }
+    pool.active = threads;
+    pool.running = threads - 1;
+    pool.idle = 0;
+    pthread_cond_broadcast(&pool.changed);
+    pthread_mutex_unlock(&pool.lock);
+
+    markAsThread(&pool.markers[0]);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.running > 0) pthread_cond_wait(&pool.changed, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void stopMarkers()
+{
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = true;
+    pthread_cond_broadcast(&pool.changed);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (int i = 0; i < pool.threadCount; i++)
+    {
+        pthread_join(pool.threads[i], NULL);
+    }
+
+    for (int i = 0; i < MAX_MARK_THREADS; i++)
+    {
+        free(pool.markers[i].shared.objects);
+        free(pool.markers[i].local.objects);
+        pool.markers[i].shared = (GrayList){NULL, 0, 0};
+        pool.markers[i].local = (GrayList){NULL, 0, 0};
+    }
+    pool.threadCount = 0;
+    pool.stopping = false;
+}
@@ -0,0 +1,16 @@
+#ifndef clox_marker_h
+#define clox_marker_h
+
+#include "common.h"
+#include "object.h"
+
+// True on every thread while they mark the heap together, in which case
+// markObject() hands its objects to markShared() instead.
+extern _Thread_local bool markingInParallel;
+
+int defaultMarkThreads();
+void markInParallel(Obj** gray, int count, int threads);
+void markShared(Obj* object);
+void stopMarkers();
+
+#endif
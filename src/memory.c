@@ -1,9 +1,18 @@
+// For clock_gettime(), which -std=c11 leaves out.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "compiler.h"
 #include "chunk.h"
+#include "gcstats.h"
+#include "marker.h"
 #include "memory.h"
 #include "object.h"
+#include "pool.h"
 #include "value.h"
 #include "vm.h"
 
@@ -12,62 +21,115 @@
 #include "debug.h"
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+// Whatever the overhead allows, the heap grows enough between cycles for
+// collecting to take at most GC_MAX_TIME percent of the time. Near the
+// heap limit, it still grows by at least 1/GC_MIN_GROWTH of what's live.
+#define GC_MAX_TIME 25
+#define GC_MIN_GROWTH 16
 
-static void blackenObject(Obj* object);
+// In incremental mode, a cycle advances by GC_SLICE_WORK objects for every
+// GC_SLICE_BYTES allocated, so it keeps up with the program however fast
+// that allocates. gcStep() works in chunks of GC_STEP_WORK between checks
+// of the clock.
+#define GC_SLICE_BYTES (64 * 1024)
+#define GC_SLICE_WORK 2048
+#define GC_STEP_WORK 256
 
-static void freeObject(Obj* object)
+// Gray objects are prefetched this many objects before they're blackened.
+#define MARK_PREFETCH_DISTANCE 8
+
+// Marking everything in one go is spread over several threads once the
+// heap is big enough for that to pay off.
+#ifdef DEBUG_STRESS_GC
+#define PARALLEL_MARK_BYTES 0
+#else
+#define PARALLEL_MARK_BYTES (8 * 1024 * 1024)
+#endif
+
+// Objects are bump allocated in the nursery and promoted to the pooled
+// old generation by the first minor collection they survive. Strings and
+// closures keep their payload inline; tables and chunks still own their
+// arrays. Objects past NURSERY_MAX_OBJECT start out old, rather than
+// filling the nursery at once.
+#define NURSERY_SIZE (512 * 1024)
+#define NURSERY_MAX_OBJECT (NURSERY_SIZE / 8)
+#define NURSERY_ALIGN(size) (((size) + POOL_GRANULE - 1) & ~(size_t)(POOL_GRANULE - 1))
+#define NURSERY_MARK_WORDS (NURSERY_SIZE / POOL_GRANULE / 64)
+
+// With compaction on, the pool is compacted once its pages are less than
+// COMPACT_MIN_USE percent full, unless it's smaller than COMPACT_MIN_BYTES.
+#ifdef DEBUG_STRESS_GC
+#define COMPACT_MIN_BYTES 0
+#else
+#define COMPACT_MIN_BYTES (4 * 1024 * 1024)
+#endif
+#define COMPACT_MIN_USE 50
+
+_Static_assert(sizeof(Obj) == 4, "the object header must fit in a word");
+_Static_assert(sizeof(ObjNative) >= 2 * sizeof(Obj*), "objects must have room for a forwarding pointer");
+
+_Thread_local LocalHeap* localHeap = NULL;
+
+static size_t objectSize(Obj* object)
+{
+    switch (object->type)
+    {
+        case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+        case OBJ_CLASS: return sizeof(ObjClass);
+        case OBJ_CLOSURE:
+            return sizeof(ObjClosure) + sizeof(ObjUpvalue*) * ((ObjClosure*)object)->upvalueCount;
+        case OBJ_FUNCTION: return sizeof(ObjFunction);
+        case OBJ_INSTANCE: return sizeof(ObjInstance);
+        case OBJ_NATIVE: return sizeof(ObjNative);
+        case OBJ_STRING: return sizeof(ObjString) + ((ObjString*)object)->length + 1;
+        case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+    }
+    return 0;
+}
+
+/*
+ * Frees what 'object' owns, but not the object itself.
+ */
+static void releaseObject(Obj* object)
 {
 #ifdef DEBUG_LOG_GC
     printf("%p free type %d\n", (void*)object, object->type);
 #endif
     switch (object->type)
     {
-        case OBJ_BOUND_METHOD:
-            FREE(ObjBoundMethod, object);
-            break;
         case OBJ_CLASS:
             freeTable(&((ObjClass*)object)->methods);
-            FREE(ObjClass, object);
             break;
-        case OBJ_CLOSURE:
-        {
-            ObjClosure* closure = (ObjClosure*)object;
-            FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-            FREE(ObjClosure, object);
-            break;
-        }
         case OBJ_FUNCTION:
         {
             ObjFunction* function = (ObjFunction*)object;
+            freeLazyBody(function);
             freeChunk(&function->chunk);
-            FREE(ObjFunction, object);
             break;
         }
         case OBJ_INSTANCE:
-        {
-            ObjInstance* instance = (ObjInstance*)object;
-            freeTable(&instance->fields);
-            FREE(ObjInstance, object);
+            freeTable(&((ObjInstance*)object)->fields);
             break;
-        }
+        case OBJ_BOUND_METHOD:
+        case OBJ_CLOSURE:
         case OBJ_NATIVE:
-            FREE(ObjNative, object);
-            break;
         case OBJ_STRING:
-        {
-            ObjString* string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
-            break;
-        }
         case OBJ_UPVALUE:
-            FREE(ObjUpvalue, object);
             break;
     }
 }
 
-static void markRoots()
+static void freeObject(Obj* object)
+{
+    releaseObject(object);
+    freeOld(object, objectSize(object));
+}
+
+/*
+ * Marks what the vm refers to directly. The globals only need marking when
+ * a cycle starts, since stores to them are shaded while it marks.
+ */
+static void markRoots(bool markGlobals)
 {
     for (Value* slot = vm.valueStack; slot < vm.valueStackTop; slot++)
     {
@@ -84,88 +146,505 @@ static void markRoots()
         markObject((Obj*)upvalue);
     }
 
-    markTable(&vm.globals);
-    markCompilerRoots();
+    for (int i = 0; i < vm.moduleCount; i++)
+    {
+        markObject((Obj*)vm.modules[i].path);
+        markObject((Obj*)vm.modules[i].function);
+    }
+
+    if (markGlobals) markTable(&vm.globals);
     markObject((Obj*)vm.initString);
 }
 
-static void traceReferences()
+static void pushGray(Obj* object)
 {
-    while (vm.grayCount > 0)
+    if (vm.grayCapacity < vm.grayCount + 1)
     {
-        Obj* object = vm.grayStack[--vm.grayCount];
-        blackenObject(object);
+        vm.grayCapacity = NEW_ARRAY_CAPACITY(vm.grayCapacity);
+        vm.grayStack = (Obj**)realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
+
+        if (vm.grayStack == NULL) exit(1);
     }
+
+    vm.grayStack[vm.grayCount++] = object;
 }
 
-static void sweep() 
+/*
+ * Blackens up to 'work' gray objects, returning how much work is left.
+ * Marking only touches the side bitmaps, so a gray object isn't read until
+ * it's blackened. Objects taken off the gray stack therefore wait in a
+ * small FIFO window first, prefetched as they go in, so they're in the
+ * cache by the time they come out. The stack itself stays depth first,
+ * which keeps it short and follows allocation order.
+ */
+static size_t traceReferences(size_t work)
 {
-    Obj* previous = NULL;
-    Obj* object = vm.objects;
+    if (work == SIZE_MAX && vm.markThreads > 1 && vm.bytesAllocated >= PARALLEL_MARK_BYTES)
+    {
+        markInParallel(vm.grayStack, vm.grayCount, vm.markThreads);
+        vm.grayCount = 0;
+        return work;
+    }
 
-    while (object != NULL)
+    Obj* window[MARK_PREFETCH_DISTANCE];
+    int head = 0;
+    int count = 0;
+    while (work > 0 && (vm.grayCount > 0 || count > 0))
     {
-        if (object->isMarked)
+        while (count < MARK_PREFETCH_DISTANCE && vm.grayCount > 0)
         {
-            object->isMarked = false;
-            previous = object;
-            object = object->next;
-        } 
-        else 
+            Obj* object = vm.grayStack[--vm.grayCount];
+            __builtin_prefetch(object);
+            window[(head + count++) % MARK_PREFETCH_DISTANCE] = object;
+        }
+
+        Obj* object = window[head];
+        head = (head + 1) % MARK_PREFETCH_DISTANCE;
+        count--;
+        blackenObject(object);
+        work--;
+    }
+
+    // Out of work: the rest go back, the one that came off last first.
+    while (count > 0)
+    {
+        count--;
+        pushGray(window[(head + count) % MARK_PREFETCH_DISTANCE]);
+    }
+    return work;
+}
+
+/*
+ * Frees the objects on 'page' that weren't marked, going by its bitmaps,
+ * and clears its marks for the next cycle. Returns how many slots it has.
+ */
+static size_t sweepPage(PoolPage* page)
+{
+    for (int i = 0; i < POOL_BITMAP_WORDS; i++)
+    {
+        uint64_t dead = page->allocated[i] & ~page->marks[i];
+        while (dead != 0)
         {
-            Obj* unreached = object;
-            object = object->next;
+            int bit = __builtin_ctzll(dead);
+            dead &= dead - 1;
+            freeObject((Obj*)slotAt(page, (size_t)i * 64 + bit));
+        }
+        page->marks[i] = 0;
+    }
+    page->needsSweep = false;
 
-            if (previous != NULL) 
-            {
-                previous->next = object;
-            } 
-            else 
-            {
-                vm.objects = object;
-            }
+    // A huge page counts as one slot.
+    size_t slots = POOL_PAGE_SIZE / page->slotSize;
+    return slots > 0 ? slots : 1;
+}
 
-            freeObject(unreached);
+/*
+ * Sweeps the next page of size class 'index' that needs it. Returns how
+ * many slots it had, or 0 once the class has none left.
+ */
+static size_t sweepNextPage(int index)
+{
+    PoolPage* page;
+    while ((page = vm.sweepCursors[index]) != NULL)
+    {
+        vm.sweepCursors[index] = page->next;
+        if (page->needsSweep) return sweepPage(page);
+    }
+    return 0;
+}
+
+static bool sweepDone()
+{
+    for (int i = 0; i < POOL_CLASS_COUNT; i++)
+    {
+        if (vm.sweepCursors[i] != NULL) return false;
+    }
+    return true;
+}
+
+/*
+ * Sweeps the pages that were there when marking ended, one after the
+ * other, until about 'work' slots were looked at. Returns how much work
+ * is left.
+ */
+static size_t sweep(size_t work)
+{
+    for (int i = 0; i < POOL_CLASS_COUNT && work > 0; i++)
+    {
+        size_t slots;
+        while (work > 0 && (slots = sweepNextPage(i)) > 0)
+        {
+            work = slots < work ? work - slots : 0;
         }
     }
+    return work;
 }
 
-void collectGarbage()
+/*
+ * Drops remembered objects the sweep is about to free.
+ */
+static void sweepRemembered()
+{
+    int count = 0;
+    for (int i = 0; i < vm.rememberedCount; i++)
+    {
+        Obj* object = vm.remembered[i];
+        if (isMarked(object)) vm.remembered[count++] = object;
+        else object->isRemembered = false;
+    }
+    vm.rememberedCount = count;
+}
+
+/*
+ * Young objects are traced like any other, but only a minor collection
+ * frees or moves them.
+ */
+static void unmarkNursery()
+{
+    memset(vm.nurseryMarks, 0, sizeof(uint64_t) * NURSERY_MARK_WORDS);
+}
+
+static void startCycle()
 {
 #ifdef DEBUG_LOG_GC
     printf("-- gc begin\n");
-    size_t before = vm.bytesAllocated;
 #endif
+    vm.gcPhase = GC_MARK;
+    vm.gcDebt = 0;
+    vm.pacer.gcAtMarkStart = gcMicros();
+    vm.pacer.allocatedAtMarkStart = vm.gcStats.bytesAllocated;
+    markRoots(true);
+}
 
-    markRoots();
-    traceReferences();
-    tableRemoveWhite(&vm.strings);
-    sweep();
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+/*
+ * Ends the mark phase in one go: roots aren't behind a write barrier, so
+ * they're marked again before whatever is still white is known dead. The
+ * pages there are at this point are then swept lazily, by slices and by
+ * allocations of their size class. Objects put on them before they're
+ * swept start out marked (see allocateOld()).
+ */
+static void finishMarking()
+{
+    markRoots(false);
+    traceReferences(SIZE_MAX);
+    sweepRemembered();
+    stringSetRemoveWhite(&vm.strings);
+    unmarkNursery();
+
+    for (int i = 0; i < POOL_CLASS_COUNT; i++)
+    {
+        for (PoolPage* page = vm.pool.classes[i].pages; page != NULL; page = page->next)
+        {
+            page->needsSweep = true;
+        }
+        vm.sweepCursors[i] = vm.pool.classes[i].pages;
+    }
+
+    vm.gcPhase = GC_SWEEP;
+    vm.pacer.markMicros = gcMicros() - vm.pacer.gcAtMarkStart;
+    vm.pacer.markAllocated = vm.gcStats.bytesAllocated - vm.pacer.allocatedAtMarkStart;
+}
+
+/*
+ * Sets the heap goal of the next cycle from what this one left, and the
+ * trigger that starts it from how fast the program allocated since the
+ * last one and what marking cost. An incremental cycle starts early
+ * enough to finish marking by the goal, if the program keeps allocating
+ * like it did during the last mark.
+ */
+static void pace()
+{
+    Pacer* pacer = &vm.pacer;
+    double now = nowMicros();
+    double gc = gcMicros();
+    double mutatorMicros = (now - pacer->cycleEnd) - (gc - pacer->gcAtCycleEnd);
+    size_t allocated = vm.gcStats.bytesAllocated - vm.gcStats.allocatedAtCycle;
+    if (mutatorMicros > 0)
+    {
+        double rate = allocated / mutatorMicros;
+        pacer->allocationRate = pacer->allocationRate == 0 ? rate : (pacer->allocationRate + rate) / 2;
+    }
+    pacer->cycleEnd = now;
+    pacer->gcAtCycleEnd = gc;
+
+    size_t live = vm.bytesAllocated;
+    size_t growth = live / 100 * pacer->overhead;
+    size_t paced = (size_t)(pacer->allocationRate * pacer->markMicros * (100 - GC_MAX_TIME) / GC_MAX_TIME);
+    if (growth < paced) growth = paced;
+
+    size_t goal = live + growth;
+    if (goal < GC_MIN_HEAP) goal = GC_MIN_HEAP;
+    if (pacer->limit > 0 && goal > pacer->limit)
+    {
+        goal = pacer->limit > live + live / GC_MIN_GROWTH ? pacer->limit : live + live / GC_MIN_GROWTH;
+    }
+    pacer->goal = goal;
+
+    size_t trigger = goal;
+    if (vm.incrementalGC)
+    {
+        size_t earliest = live + (goal - live) / 2;
+        trigger = goal - earliest > pacer->markAllocated ? goal - pacer->markAllocated : earliest;
+    }
+    vm.nextGC = trigger;
+}
+
+static void finishSweeping()
+{
+    vm.gcPhase = GC_IDLE;
+    poolFreeHuge(&vm.pool);
+    pace();
+    recordCycle();
+    if (vm.bytesAllocated <= vm.budget.soft) vm.budget.overSoft = false;
+
+    if (vm.compactGC && !vm.compactPending)
+    {
+        size_t used, reserved;
+        poolUsage(&vm.pool, &used, &reserved);
+        if (reserved > COMPACT_MIN_BYTES && used * 100 < reserved * COMPACT_MIN_USE) requestCompaction();
+    }
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
-    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-            before - vm.bytesAllocated, before, vm.bytesAllocated,
-            vm.nextGC);
+    printf("   %zu bytes in use, next at %zu, goal %zu\n", vm.bytesAllocated, vm.nextGC, vm.pacer.goal);
 #endif
 }
 
+/*
+ * Does up to 'work' units of the cycle in progress: an object blackened
+ * or swept each. Returns true once the cycle is over.
+ */
+static bool collectSlice(size_t work)
+{
+    if (vm.gcPhase == GC_MARK)
+    {
+        work = traceReferences(work);
+        if (vm.grayCount > 0) return false;
+        finishMarking();
+    }
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize)
+    if (vm.gcPhase == GC_SWEEP)
+    {
+        sweep(work);
+        if (!sweepDone()) return false;
+        finishSweeping();
+    }
+    return true;
+}
+
+/*
+ * A full mark, which finishes the cycle in progress first. The sweep is
+ * left for later slices and allocations, so the pause doesn't grow with
+ * the garbage. Nothing moves, so it can run in the middle of any
+ * allocation.
+ */
+void collectGarbage()
 {
-    vm.bytesAllocated += newSize - oldSize;
+    if (vm.gcPhase != GC_IDLE) collectSlice(SIZE_MAX);
+    startCycle();
+    traceReferences(SIZE_MAX);
+    finishMarking();
+}
 
-    if (newSize > oldSize)
+/*
+ * A full collection with its sweep done too, for when memory is needed
+ * back right away.
+ */
+static void collectFully()
+{
+    beginGcPause();
+    collectGarbage();
+    collectSlice(SIZE_MAX);
+    endGcPause();
+}
+
+/*
+ * Runs as much of a cycle as 'budgetMicros' allows, starting one early
+ * once the heap is three quarters of the way to its next threshold, so a
+ * host can get it done while it's idle. Returns true if a cycle is still
+ * in progress.
+ */
+bool gcStep(double budgetMicros)
+{
+    if (vm.gcPaused) return vm.gcPhase != GC_IDLE;
+    if (vm.gcPhase == GC_IDLE && vm.bytesAllocated < vm.nextGC / 4 * 3) return false;
+
+    beginGcPause();
+    if (vm.gcPhase == GC_IDLE) startCycle();
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool inProgress = false;
+    while (!collectSlice(GC_STEP_WORK))
     {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double elapsed = (now.tv_sec - start.tv_sec) * 1e6 + (now.tv_nsec - start.tv_nsec) / 1e3;
+        if (elapsed >= budgetMicros)
+        {
+            inProgress = true;
+            break;
+        }
+    }
+    endGcPause();
+    return inProgress;
+}
+
+/*
+ * Collects if 'bytes' more pushes the heap past its threshold. In
+ * incremental mode that starts a cycle instead. Every GC_SLICE_BYTES
+ * allocated while a cycle or its sweep is in progress pays for a slice,
+ * unless the heap is past a goal capped by the heap limit, which has the
+ * rest done right away.
+ */
+static void collectForAllocation(size_t bytes)
+{
 #ifdef DEBUG_STRESS_GC
+    // Incremental cycles run back to back, one object at a time.
+    beginGcPause();
+    if (!vm.incrementalGC)
+    {
         collectGarbage();
+    }
+    else
+    {
+        if (vm.gcPhase == GC_IDLE) startCycle();
+        collectSlice(1);
+    }
+    endGcPause();
+    return;
 #endif
-        if (vm.bytesAllocated > vm.nextGC) 
+
+    if (vm.gcPhase != GC_IDLE)
+    {
+        vm.gcDebt += bytes;
+        if (vm.gcDebt < GC_SLICE_BYTES) return;
+
+        vm.gcDebt = 0;
+        bool pressed = vm.pacer.limit > 0 && vm.bytesAllocated > vm.pacer.goal;
+        beginGcPause();
+        collectSlice(pressed ? SIZE_MAX : GC_SLICE_WORK);
+        endGcPause();
+    }
+    else if (vm.bytesAllocated > vm.nextGC)
+    {
+        beginGcPause();
+        if (vm.incrementalGC) startCycle();
+        else collectGarbage();
+        endGcPause();
+    }
+}
+
+void setMemoryBudget(size_t soft, size_t hard, void (*onSoftLimit)(size_t bytesInUse))
+{
+    vm.budget.soft = soft > 0 ? soft : SIZE_MAX;
+    vm.budget.hard = hard > 0 ? hard : SIZE_MAX;
+    vm.budget.onSoftLimit = onSoftLimit;
+    vm.budget.overSoft = false;
+}
+
+/*
+ * Collects everything the first time the heap is past the soft limit, and
+ * tells the host. Past the hard limit it collects every time, and if that
+ * doesn't help, has the script fail at the next safepoint (see
+ * memoryExhausted()), where it can be unwound cleanly.
+ */
+static void checkBudget()
+{
+    if (vm.bytesAllocated > vm.budget.soft && !vm.budget.overSoft)
+    {
+        vm.budget.overSoft = true;
+        collectFully();
+        if (vm.budget.onSoftLimit != NULL) vm.budget.onSoftLimit(vm.bytesAllocated);
+    }
+
+    if (vm.bytesAllocated > vm.budget.hard && !vm.outOfMemory)
+    {
+        collectFully();
+        if (vm.bytesAllocated > vm.budget.hard)
+        {
+            vm.outOfMemory = true;
+            vm.nurseryFull = true;
+        }
+    }
+}
+
+/*
+ * Whether an allocation went past the hard limit, and the minor collection
+ * that just ran didn't bring the heap back under it. Clears the condition.
+ */
+bool memoryExhausted()
+{
+    if (!vm.outOfMemory) return false;
+
+    vm.outOfMemory = false;
+    return vm.bytesAllocated > vm.budget.hard;
+}
+
+/*
+ * Counts the change in size of an allocation against the heap this thread
+ * allocates on, collecting first if that's the vm's and it grew.
+ */
+static void account(size_t oldSize, size_t newSize)
+{
+    if (localHeap != NULL)
+    {
+        localHeap->bytesAllocated += newSize - oldSize;
+    }
+    else
+    {
+        vm.bytesAllocated += newSize - oldSize;
+        if (newSize <= oldSize)
         {
-            collectGarbage();
+            vm.gcStats.bytesFreed += oldSize - newSize;
+            return;
         }
+
+        vm.gcStats.bytesAllocated += newSize - oldSize;
+        if (vm.gcPaused) return;
+
+        collectForAllocation(newSize - oldSize);
+        if (vm.bytesAllocated > vm.budget.soft || vm.bytesAllocated > vm.budget.hard) checkBudget();
     }
+}
+
+static Pool* currentPool()
+{
+    return localHeap != NULL ? &localHeap->pool : &vm.pool;
+}
+
+/*
+ * Memory for an object in the old generation, or on a local heap. It
+ * comes from the pool of its size class rather than from malloc.
+ */
+void* allocateOld(size_t size)
+{
+    account(0, size);
+
+    // Garbage of the same size is reused before the pool grows. Huge
+    // objects aren't: each gets a new page.
+    int index = sizeClassOf(size);
+    if (localHeap == NULL && vm.gcPhase == GC_SWEEP && index != POOL_HUGE_CLASS)
+    {
+        while (vm.pool.classes[index].freeSlots == NULL && sweepNextPage(index) > 0) {}
+    }
+
+    void* slot = poolAllocate(currentPool(), size);
+
+    // The sweep mustn't take it for garbage.
+    PoolPage* page = pageOf(slot);
+    if (page->needsSweep) setBit(page->marks, granuleOf(page, slot));
+    return slot;
+}
+
+void freeOld(void* object, size_t size)
+{
+    account(size, 0);
+    poolFree(currentPool(), object, size);
+}
+
+void* reallocate(void* pointer, size_t oldSize, size_t newSize)
+{
+    account(oldSize, newSize);
 
     if (newSize == 0)
     {
@@ -174,26 +653,544 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize)
     }
 
     void* result = realloc(pointer, newSize);
+    if (result == NULL && localHeap == NULL && !vm.gcPaused)
+    {
+        // Whatever garbage there is might make room.
+        collectFully();
+        result = realloc(pointer, newSize);
+    }
     if (result == NULL) exit(1); // Realloc fail. Can't recover.
     return result;
 }
 
-void freeObjects()
+void initNursery()
+{
+    vm.nursery = (uint8_t*)malloc(NURSERY_SIZE);
+    vm.nurseryMarks = (uint64_t*)calloc(NURSERY_MARK_WORDS, sizeof(uint64_t));
+    if (vm.nursery == NULL || vm.nurseryMarks == NULL) exit(1);
+    vm.nurseryTop = vm.nursery;
+    vm.nurseryEnd = vm.nursery + NURSERY_SIZE;
+    vm.nurseryFull = false;
+}
+
+/*
+ * Bumps 'size' bytes off the nursery, or returns NULL and asks for a
+ * minor collection if it's full. Returns NULL as well for objects too big
+ * to go there.
+ */
+void* allocateYoung(size_t size)
+{
+#ifdef DEBUG_STRESS_GC
+    if (!vm.gcPaused) collectForAllocation(size);
+    vm.nurseryFull = true;
+#endif
+
+    if (size > NURSERY_MAX_OBJECT) return NULL;
+
+    size = NURSERY_ALIGN(size);
+    if ((size_t)(vm.nurseryEnd - vm.nurseryTop) < size)
+    {
+        vm.nurseryFull = true;
+        return NULL;
+    }
+
+    void* result = vm.nurseryTop;
+    vm.nurseryTop += size;
+    return result;
+}
+
+void rememberObject(Obj* object)
+{
+    if (object->isRemembered) return;
+
+    if (vm.rememberedCapacity < vm.rememberedCount + 1)
+    {
+        vm.rememberedCapacity = NEW_ARRAY_CAPACITY(vm.rememberedCapacity);
+        vm.remembered = (Obj**)realloc(vm.remembered, sizeof(Obj*) * vm.rememberedCapacity);
+
+        if (vm.remembered == NULL) exit(1);
+    }
+
+    object->isRemembered = true;
+    vm.remembered[vm.rememberedCount++] = object;
+}
+
+// Where a moved object keeps the address of its copy: the first aligned
+// word past the header, which every object has. The header stays intact,
+// so the nursery can still be walked.
+static Obj** forwarding(Obj* object)
+{
+    return (Obj**)((uint8_t*)object + sizeof(Obj*));
+}
+
+/*
+ * Leaves 'object' pointing at 'copy', which has just been copied from it.
+ */
+static void forwardTo(Obj* object, Obj* copy)
+{
+    // A closed upvalue points at its own 'closed' field.
+    if (object->type == OBJ_UPVALUE)
+    {
+        ObjUpvalue* upvalue = (ObjUpvalue*)copy;
+        if (upvalue->location == &((ObjUpvalue*)object)->closed) upvalue->location = &upvalue->closed;
+    }
+
+    object->isForwarded = true;
+    *forwarding(object) = copy;
+}
+
+/*
+ * Copies a young object to the old generation, unless an earlier
+ * reference to it already did, and returns where it lives now. Old
+ * objects only move when the heap is compacted, which relies on this to
+ * follow them too.
+ */
+static Obj* promoteObject(Obj* object)
+{
+    if (object == NULL) return object;
+    if (object->isForwarded) return *forwarding(object);
+    if (!object->isYoung) return object;
+
+    size_t size = objectSize(object);
+    Obj* copy = (Obj*)allocateOld(size);
+    memcpy(copy, object, size);
+    copy->isYoung = false;
+    if (isMarked(object)) setMarked(copy);
+
+    forwardTo(object, copy);
+    pushGray(copy);
+    return copy;
+}
+
+#define PROMOTE(field) ((field) = (void*)promoteObject((Obj*)(field)))
+
+static void promoteValue(Value* value)
+{
+    if (IS_OBJ(*value)) value->as.obj = promoteObject(AS_OBJ(*value));
+}
+
+static void promoteTable(Table* table)
 {
-    Obj* object = vm.objects;
-    while (object != NULL)
+    // Entries keep their slots, as the keys' hashes don't change.
+    for (int i = 0; i < table->capacity; i++)
+    {
+        if (!tableSlotInUse(table, i)) continue;
+        PROMOTE(tableKeys(table)[i]);
+        promoteValue(&tableValues(table)[i]);
+    }
+}
+
+static void promoteStrings(StringSet* set)
+{
+    for (int i = 0; i < set->capacity; i++)
+    {
+        if (stringSetSlotInUse(set, i)) PROMOTE(stringSetKeys(set)[i]);
+    }
+}
+
+static void promoteReferences(Obj* object)
+{
+    switch (object->type)
+    {
+        case OBJ_BOUND_METHOD:
+        {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            promoteValue(&bound->receiver);
+            PROMOTE(bound->method);
+            break;
+        }
+        case OBJ_CLASS:
+        {
+            ObjClass* klass = (ObjClass*)object;
+            PROMOTE(klass->name);
+            promoteTable(&klass->methods);
+            break;
+        }
+        case OBJ_CLOSURE:
+        {
+            ObjClosure* closure = (ObjClosure*)object;
+            PROMOTE(closure->function);
+            for (int i = 0; i < closure->upvalueCount; i++)
+            {
+                PROMOTE(closure->upvalues[i]);
+            }
+            break;
+        }
+        case OBJ_FUNCTION:
+        {
+            ObjFunction* function = (ObjFunction*)object;
+            PROMOTE(function->name);
+            for (int i = 0; i < function->chunk.constants.count; i++)
+            {
+                promoteValue(&function->chunk.constants.values[i]);
+            }
+            break;
+        }
+        case OBJ_INSTANCE:
+        {
+            ObjInstance* instance = (ObjInstance*)object;
+            PROMOTE(instance->klass);
+            promoteTable(&instance->fields);
+            break;
+        }
+        case OBJ_NATIVE:
+        case OBJ_STRING:
+            break;
+        case OBJ_UPVALUE:
+            promoteValue(&((ObjUpvalue*)object)->closed);
+            break;
+    }
+}
+
+/*
+ * The globals only need looking at if they may refer to objects that move.
+ */
+static void promoteRoots(bool globals)
+{
+    for (Value* slot = vm.valueStack; slot < vm.valueStackTop; slot++)
+    {
+        promoteValue(slot);
+    }
+
+    for (int i = 0; i < vm.frameCount; i++)
+    {
+        PROMOTE(vm.frames[i].closure);
+    }
+
+    for (ObjUpvalue** upvalue = &vm.openUpvalues; *upvalue != NULL; upvalue = &(*upvalue)->next)
+    {
+        PROMOTE(*upvalue);
+    }
+
+    for (int i = 0; i < vm.moduleCount; i++)
+    {
+        PROMOTE(vm.modules[i].path);
+        PROMOTE(vm.modules[i].function);
+    }
+
+    if (globals) promoteTable(&vm.globals);
+    PROMOTE(vm.initString);
+}
+
+static void compactHeap();
+
+/*
+ * Interned strings are weak references, so the table has to follow the
+ * young ones that moved and forget the ones that died. Everything else
+ * that died just gives back what it owns.
+ */
+static void sweepNursery()
+{
+    for (uint8_t* start = vm.nursery; start < vm.nurseryTop;)
+    {
+        Obj* object = (Obj*)start;
+        start += NURSERY_ALIGN(objectSize(object));
+
+        if (object->isForwarded)
+        {
+            if (object->type == OBJ_STRING)
+            {
+                stringSetReplace(&vm.strings, (ObjString*)object, (ObjString*)*forwarding(object));
+            }
+            continue;
+        }
+
+        if (object->type == OBJ_STRING) stringSetDelete(&vm.strings, (ObjString*)object);
+        releaseObject(object);
+    }
+
+#ifdef DEBUG_STRESS_GC
+    // Make anything still pointing into the nursery fail loudly.
+    memset(vm.nursery, 0xdb, (size_t)(vm.nurseryTop - vm.nursery));
+#endif
+    vm.nurseryTop = vm.nursery;
+    unmarkNursery();
+}
+
+/*
+ * Points gray objects the minor collection moved at their copy, and drops
+ * those it found dead, so marking can carry on where it was.
+ */
+static void forwardGrayStack(int count)
+{
+    int kept = 0;
+    for (int i = 0; i < count; i++)
+    {
+        Obj* object = vm.grayStack[i];
+        if (object->isYoung) object = object->isForwarded ? *forwarding(object) : NULL;
+        if (object != NULL) vm.grayStack[kept++] = object;
+    }
+    vm.grayCount = kept;
+}
+
+/*
+ * Promotes every young object that's still reachable and empties the
+ * nursery. Objects move, so this may only run at a safepoint, where no C
+ * code holds on to a young object (see run()). The copies keep the mark
+ * bits of the originals, so a cycle that's marking isn't disturbed.
+ */
+void collectNursery()
+{
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
+    size_t before = vm.bytesAllocated;
+#endif
+
+    beginGcPause();
+    bool wasPaused = vm.gcPaused;
+    vm.gcPaused = true;
+
+    // Gray objects of the cycle in progress stay at the bottom of the
+    // stack; the ones promoted go on top.
+    int grayCount = vm.grayCount;
+
+    promoteRoots(vm.globalsDirty);
+    for (int i = 0; i < vm.rememberedCount; i++)
+    {
+        vm.remembered[i]->isRemembered = false;
+        promoteReferences(vm.remembered[i]);
+    }
+    vm.rememberedCount = 0;
+
+    while (vm.grayCount > grayCount)
+    {
+        promoteReferences(vm.grayStack[--vm.grayCount]);
+    }
+
+    forwardGrayStack(grayCount);
+    sweepNursery();
+    vm.nurseryFull = false;
+    vm.globalsDirty = false;
+    vm.gcPaused = wasPaused;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   promoted %zu bytes\n", vm.bytesAllocated - before);
+#endif
+
+    if (!vm.gcPaused) collectForAllocation(0);
+    if (vm.compactPending && !vm.gcPaused) compactHeap();
+    vm.gcStats.minorCollections++;
+    endGcPause();
+}
+
+/*
+ * The barrier for copying a whole table into 'owner'.
+ */
+void writeBarrierTable(Obj* owner, Table* table)
+{
+    for (int i = 0; i < table->capacity; i++)
+    {
+        if (!tableSlotInUse(table, i)) continue;
+        writeBarrier(owner, OBJ_VAL(tableKeys(table)[i]));
+        writeBarrier(owner, tableValues(table)[i]);
+    }
+}
+
+/*
+ * Keeps 'value' reachable across allocations that might collect. Nothing
+ * on a local heap gets collected, and the vm stack isn't ours to touch
+ * from another thread anyway.
+ */
+void pushRoot(Value value)
+{
+    if (localHeap == NULL) pushValue(value);
+}
+
+void popRoot()
+{
+    if (localHeap == NULL) popValue();
+}
+
+void initLocalHeap(LocalHeap* heap)
+{
+    initStringSet(&heap->strings);
+    heap->bytesAllocated = 0;
+    initPool(&heap->pool);
+}
+
+static ObjString* internedString(ObjString* string)
+{
+    return stringSetFind(&vm.strings, string->chars, string->length, string->hash);
+}
+
+/*
+ * Calls 'visit' on every object in 'pool', which may free it.
+ */
+static void forEachObject(Pool* pool, void (*visit)(Obj* object))
+{
+    for (int i = 0; i < POOL_CLASS_COUNT; i++)
+    {
+        for (PoolPage* page = pool->classes[i].pages; page != NULL; page = page->next)
+        {
+            for (int word = 0; word < POOL_BITMAP_WORDS; word++)
+            {
+                uint64_t allocated = page->allocated[word];
+                while (allocated != 0)
+                {
+                    int bit = __builtin_ctzll(allocated);
+                    allocated &= allocated - 1;
+                    visit((Obj*)slotAt(page, (size_t)word * 64 + bit));
+                }
+            }
+        }
+    }
+}
+
+static void moveObject(void* from, void* to)
+{
+    Obj* object = (Obj*)from;
+    memcpy(to, object, objectSize(object));
+    forwardTo(object, (Obj*)to);
+}
+
+/*
+ * Compacts the heap at the next safepoint, after a minor collection.
+ */
+void requestCompaction()
+{
+    vm.compactPending = true;
+    vm.nurseryFull = true;
+}
+
+/*
+ * Collects everything, then packs the old objects onto as few pages as
+ * they fit on and gives the pages that frees up back to the OS. Runs
+ * right after a minor collection at a safepoint, so there are no young
+ * objects, and only the vm's roots and other objects refer to the ones
+ * that move. They're followed like promoted ones (see promoteObject()).
+ */
+static void compactHeap()
+{
+    collectFully();
+    vm.compactPending = false;
+    vm.gcStats.compactions++;
+
+    int emptied = poolEvacuate(&vm.pool, moveObject);
+    if (emptied == 0) return;
+
+    promoteRoots(true);
+    promoteStrings(&vm.strings);
+    forEachObject(&vm.pool, promoteReferences);
+    poolReleaseEvacuated(&vm.pool);
+
+#ifdef DEBUG_LOG_GC
+    printf("-- compacted, released %d pages\n", emptied);
+#endif
+}
+
+static size_t* objectCounts;
+
+static void countObject(Obj* object)
+{
+    objectCounts[object->type]++;
+}
+
+/*
+ * Counts the objects on the heap by type, young ones included.
+ */
+void countObjects(size_t counts[])
+{
+    memset(counts, 0, sizeof(size_t) * OBJ_TYPE_COUNT);
+    objectCounts = counts;
+    forEachObject(&vm.pool, countObject);
+
+    for (uint8_t* start = vm.nursery; start < vm.nurseryTop;)
+    {
+        Obj* young = (Obj*)start;
+        start += NURSERY_ALIGN(objectSize(young));
+        countObject(young);
+    }
+}
+
+static void internString(Obj* object)
+{
+    if (object->type != OBJ_STRING) return;
+
+    ObjString* string = (ObjString*)object;
+    if (internedString(string) == NULL) stringSetAdd(&vm.strings, string);
+}
+
+static void useInternedStrings(Obj* object)
+{
+    if (object->type != OBJ_FUNCTION) return;
+
+    ObjFunction* function = (ObjFunction*)object;
+    if (function->name != NULL)
+    {
+        function->name = internedString(function->name);
+        writeBarrier(object, OBJ_VAL(function->name));
+    }
+
+    ValueArray* constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++)
+    {
+        if (IS_STRING(constants->values[i]))
+        {
+            constants->values[i] = OBJ_VAL(internedString(AS_STRING(constants->values[i])));
+            writeBarrier(object, constants->values[i]);
+        }
+    }
+}
+
+static void freeDuplicateString(Obj* object)
+{
+    if (object->type == OBJ_STRING && internedString((ObjString*)object) != (ObjString*)object)
     {
-        Obj* next = object->next;
         freeObject(object);
-        object = next;
     }
+}
+
+/*
+ * Moves every object on 'heap' into the vm. Strings the vm already
+ * interned are swapped for its copy wherever a function uses them, so
+ * there's still one object per distinct string.
+ */
+void mergeHeap(LocalHeap* heap)
+{
+    bool wasPaused = vm.gcPaused;
+    vm.gcPaused = true;
+    vm.bytesAllocated += heap->bytesAllocated;
+    vm.gcStats.bytesAllocated += heap->bytesAllocated;
+
+    forEachObject(&heap->pool, internString);
+    forEachObject(&heap->pool, useInternedStrings);
+    forEachObject(&heap->pool, freeDuplicateString);
+    mergePool(&vm.pool, &heap->pool);
 
+    freeStringSet(&heap->strings);
+    heap->bytesAllocated = 0;
+    vm.gcPaused = wasPaused;
+}
+
+void freeObjects()
+{
+    forEachObject(&vm.pool, releaseObject);
+    freePool(&vm.pool);
+
+    for (uint8_t* start = vm.nursery; start < vm.nurseryTop;)
+    {
+        Obj* young = (Obj*)start;
+        start += NURSERY_ALIGN(objectSize(young));
+        releaseObject(young);
+    }
+
+    free(vm.nursery);
+    free(vm.nurseryMarks);
+    free(vm.remembered);
     free(vm.grayStack);
+    stopMarkers();
 }
 
 void markObject(Obj* object)
 {
-    if (object == NULL || object->isMarked) return;
+    if (object == NULL) return;
+    if (markingInParallel)
+    {
+        markShared(object);
+        return;
+    }
+    if (isMarked(object)) return;
 
 #ifdef DEBUG_LOG_GC
     printf("%p mark ", (void*)object);
@@ -201,17 +1198,8 @@ void markObject(Obj* object)
     printf("\n");
 #endif
 
-    object->isMarked = true;
-
-    if (vm.grayCapacity < vm.grayCount + 1)
-    {
-        vm.grayCapacity = NEW_ARRAY_CAPACITY(vm.grayCapacity);
-        vm.grayStack = (Obj**)realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
-
-        if (vm.grayStack == NULL) exit(1);
-    }
-
-    vm.grayStack[vm.grayCount++] = object;
+    setMarked(object);
+    pushGray(object);
 }
 
 void markValue(Value value)
@@ -227,7 +1215,7 @@ static void markArray(ValueArray* array)
     }
 }
 
-static void blackenObject(Obj* object)
+void blackenObject(Obj* object)
 {
 #ifdef DEBUG_LOG_GC
     printf("%p blacken ", (void*)object);
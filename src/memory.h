@@ -3,9 +3,16 @@
 
 #include "common.h"
 #include "object.h"
+#include "pool.h"
+#include "table.h"
+#include "vm.h"
 
 #define MIN_CHUNK_CAPACITY 8
 
+// The heap size the first cycle starts at, and the smallest any later
+// one aims for.
+#define GC_MIN_HEAP (4 * 1024 * 1024)
+
 #define NEW_ARRAY_CAPACITY(capacity) \
 	((capacity) < MIN_CHUNK_CAPACITY ? MIN_CHUNK_CAPACITY : (capacity) * 2)
 
@@ -20,10 +27,86 @@
 #define FREE_ARRAY(type, pointer, oldCount) \
 	reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+// Threads other than the vm's own allocate on a local heap, which is never
+// collected, until mergeHeap() moves its objects into the vm. Compiling is
+// the only thing that happens on a local heap.
+typedef struct
+{
+	StringSet strings;			// Strings interned on this heap
+	size_t bytesAllocated;
+	Pool pool;					// Where its objects are allocated
+} LocalHeap;
+
+extern _Thread_local LocalHeap* localHeap;
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+void* allocateOld(size_t size);
+void freeOld(void* object, size_t size);
+void initNursery();
+void* allocateYoung(size_t size);
+void rememberObject(Obj* object);
+void collectNursery();
+void initLocalHeap(LocalHeap* heap);
+void mergeHeap(LocalHeap* heap);
+void pushRoot(Value value);
+void popRoot();
 void collectGarbate();
+bool gcStep(double budgetMicros);
+void requestCompaction();
+void countObjects(size_t counts[]);
+void setMemoryBudget(size_t soft, size_t hard, void (*onSoftLimit)(size_t bytesInUse));
+bool memoryExhausted();
 void markObject(Obj* object);
+void blackenObject(Obj* object);
 void markValue(Value value);
 void freeObjects();
 
+static inline bool isYoung(Value value)
+{
+	return IS_OBJ(value) && AS_OBJ(value)->isYoung;
+}
+
+// Mark bits live in bitmaps rather than in the objects: the bitmap in the
+// header of an old object's page (see pool.h), or vm.nurseryMarks for a
+// young one, which maps the nursery the same way.
+static inline uint64_t* markBitmap(Obj* object, size_t* index)
+{
+	if (object->isYoung)
+	{
+		*index = granuleOf(vm.nursery, object);
+		return vm.nurseryMarks;
+	}
+
+	PoolPage* page = pageOf(object);
+	*index = granuleOf(page, object);
+	return page->marks;
+}
+
+static inline bool isMarked(Obj* object)
+{
+	size_t index;
+	uint64_t* bits = markBitmap(object, &index);
+	return testBit(bits, index);
+}
+
+static inline void setMarked(Obj* object)
+{
+	size_t index;
+	uint64_t* bits = markBitmap(object, &index);
+	setBit(bits, index);
+}
+
+// Minor collections only trace the nursery, so an old object has to be
+// remembered once a young one is stored in it. While an incremental cycle
+// marks, a value stored in an object that's already been marked is shaded,
+// so the cycle can't miss it. Objects on a local heap are never marked,
+// which keeps compile threads from looking at the vm here.
+static inline void writeBarrier(Obj* owner, Value value)
+{
+	if (isMarked(owner) && vm.gcPhase == GC_MARK) markValue(value);
+	if (!owner->isYoung && !owner->isRemembered && isYoung(value)) rememberObject(owner);
+}
+
+void writeBarrierTable(Obj* owner, Table* table);
+
 #endif
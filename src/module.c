@@ -0,0 +1,228 @@
+// For realpath(), which is X/Open and left out under -std=c11.
+#define _XOPEN_SOURCE 700
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "compiler.h"
+#include "image.h"
+#include "memory.h"
+#include "module.h"
+#include "object.h"
+#include "scanner.h"
+#include "vm.h"
+
+#define MAX_COMPILE_THREADS 8
+
+// Every module a script imports, directly or not, is compiled ahead of
+// time on a pool of threads while the script itself compiles on the vm's
+// thread. Each file compiles onto its own local heap, and the results are
+// merged into the vm and registered as modules that haven't run yet.
+typedef struct Job
+{
+    struct Job* next;           // Next job, in the order they were found
+    struct Job* nextQueued;     // Next job no thread has picked up yet
+    char* path;                 // Canonical path of the module
+    char* source;
+    uint64_t hash;
+    LocalHeap heap;
+    ObjFunction* function;      // NULL if it couldn't be read or compiled
+} Job;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     // Signalled when a job is queued or all are done
+    const char* root;           // Path of the script the graph starts from
+    Job* jobs;
+    Job* lastJob;
+    Job* queue;
+    int busy;                   // Number of threads compiling right now
+    pthread_t threads[MAX_COMPILE_THREADS];
+    int threadCount;
+} CompilePool;
+
+static CompilePool pool = {.lock = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER};
+
+/*
+ * Reads a whole file, or returns NULL if it can't.
+ */
+char* readSource(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    long fileSize = ftell(file);
+    rewind(file);
+
+    char* source = fileSize < 0 ? NULL : (char*)malloc((size_t)fileSize + 1);
+    if (source != NULL)
+    {
+        size_t bytesRead = fread(source, sizeof(char), (size_t)fileSize, file);
+        source[bytesRead] = '\0';
+    }
+
+    fclose(file);
+    return source;
+}
+
+/*
+ * Queues the module at 'path' unless it's already known. Takes ownership
+ * of 'path'. The pool lock must be held.
+ */
+static void queueModule(char* path)
+{
+    bool known = strcmp(path, pool.root) == 0;
+    for (Job* job = pool.jobs; job != NULL && !known; job = job->next)
+    {
+        known = strcmp(path, job->path) == 0;
+    }
+
+    if (known)
+    {
+        free(path);
+        return;
+    }
+
+    Job* job = (Job*)malloc(sizeof(Job));
+    if (job == NULL) exit(1);
+    job->next = NULL;
+    job->nextQueued = pool.queue;
+    job->path = path;
+    job->source = NULL;
+    job->hash = 0;
+    job->function = NULL;
+    initLocalHeap(&job->heap);
+
+    if (pool.lastJob != NULL) pool.lastJob->next = job;
+    else pool.jobs = job;
+    pool.lastJob = job;
+    pool.queue = job;
+    pthread_cond_signal(&pool.changed);
+}
+
+/*
+ * Queues every module 'source' imports. Paths that don't resolve to a file
+ * are left for the import itself to report. The pool lock must be held.
+ */
+static void queueImports(const char* path, const char* source)
+{
+    Scanner scanner;
+    initScanner(&scanner, source, 1);
+
+    char* import;
+    while ((import = nextImport(&scanner, path)) != NULL)
+    {
+        char* fullPath = realpath(import, NULL);
+        FREE_ARRAY(char, import, strlen(import) + 1);
+        if (fullPath != NULL) queueModule(fullPath);
+    }
+}
+
+static void compileJob(Job* job)
+{
+    job->source = readSource(job->path);
+    if (job->source == NULL) return;
+
+    job->hash = hashSource(job->source);
+    pthread_mutex_lock(&pool.lock);
+    queueImports(job->path, job->source);
+    pthread_mutex_unlock(&pool.lock);
+
+    job->function = compileCached(job->path, job->source);
+}
+
+static void* compileThread(void* unused)
+{
+    pthread_mutex_lock(&pool.lock);
+    while (1)
+    {
+        while (pool.queue == NULL && pool.busy > 0)
+        {
+            pthread_cond_wait(&pool.changed, &pool.lock);
+        }
+        if (pool.queue == NULL) break;
+
+        Job* job = pool.queue;
+        pool.queue = job->nextQueued;
+        pool.busy++;
+        pthread_mutex_unlock(&pool.lock);
+
+        localHeap = &job->heap;
+        compileJob(job);
+        localHeap = NULL;
+
+        pthread_mutex_lock(&pool.lock);
+        pool.busy--;
+    }
+
+    // Nothing is queued and nothing is compiling that could queue more.
+    pthread_cond_broadcast(&pool.changed);
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+/*
+ * Starts compiling the modules imported by the script at 'path' in the
+ * background. Does nothing in lazy mode, where compiling is cheap to
+ * begin with.
+ */
+void startPrecompile(const char* path, const char* source)
+{
+    if (vm.lazyCompile) return;
+
+    pool.root = path;
+    queueImports(path, source);
+    if (pool.queue == NULL) return;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus < 1 ? 1 : cpus > MAX_COMPILE_THREADS ? MAX_COMPILE_THREADS : (int)cpus;
+    for (int i = 0; i < threads; i++)
+    {
+        if (pthread_create(&pool.threads[pool.threadCount], NULL, compileThread, NULL) != 0) break;
+        pool.threadCount++;
+    }
+}
+
+/*
+ * Waits for the modules started by startPrecompile() and moves them into
+ * the vm. Modules that failed to compile get compiled again when they're
+ * imported, which reports their errors at the right time.
+ */
+void finishPrecompile()
+{
+    if (pool.jobs == NULL) return;
+
+    if (pool.threadCount == 0)
+    {
+        compileThread(NULL);
+    }
+    for (int i = 0; i < pool.threadCount; i++)
+    {
+        pthread_join(pool.threads[i], NULL);
+    }
+
+    Job* job = pool.jobs;
+    while (job != NULL)
+    {
+        mergeHeap(&job->heap);
+        if (job->function != NULL) addCompiledModule(job->path, job->hash, job->function);
+
+        Job* next = job->next;
+        free(job->path);
+        free(job->source);
+        free(job);
+        job = next;
+    }
+
+    pool.root = NULL;
+    pool.jobs = NULL;
+    pool.lastJob = NULL;
+    pool.threadCount = 0;
+}
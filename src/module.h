@@ -0,0 +1,10 @@
+#ifndef clox_module_h
+#define clox_module_h
+
+#include "common.h"
+
+char* readSource(const char* path);
+void startPrecompile(const char* path, const char* source);
+void finishPrecompile();
+
+#endif
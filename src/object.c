@@ -10,13 +10,30 @@
 #define ALLOCATE_OBJ(type, objectType) \
     (type*)allocateObject(sizeof(type), objectType)
 
+/*
+ * New objects go in the nursery. When it's full they go straight in the
+ * old generation instead, until the next minor collection empties it.
+ */
 static Obj* allocateObject(size_t size, ObjType type)
 {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
+    Obj* object = localHeap == NULL ? (Obj*)allocateYoung(size) : NULL;
+    if (object != NULL)
+    {
+        object->isYoung = true;
+        object->isRemembered = false;
+    }
+    else
+    {
+        object = (Obj*)allocateOld(size);
+        object->isYoung = false;
+        object->isRemembered = false;
+
+        // Whoever creates it may store young objects in it without a
+        // barrier.
+        if (localHeap == NULL) rememberObject(object);
+    }
     object->type = type;
-    object->isMarked = false;
-    object->next = vm.objects;
-    vm.objects = object;
+    object->isForwarded = false;
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -42,16 +59,15 @@ ObjClass* newClass(ObjString* name) {
 
 ObjClosure* newClosure(ObjFunction* function)
 {
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
-    for (int i = 0; i < function->upvalueCount; i++)
+    int upvalueCount = function->upvalueCount;
+    ObjClosure* closure = (ObjClosure*)allocateObject(
+        sizeof(ObjClosure) + sizeof(ObjUpvalue*) * upvalueCount, OBJ_CLOSURE);
+    closure->function = function;
+    closure->upvalueCount = upvalueCount;
+    for (int i = 0; i < upvalueCount; i++)
     {
-        upvalues[i] = NULL;
+        closure->upvalues[i] = NULL;
     }
-
-    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
-    closure-> function = function;
-    closure->upvalues = upvalues;
-    closure->upvalueCount = function->upvalueCount;
     return closure;
 }
 
@@ -60,7 +76,9 @@ ObjFunction* newFunction()
     ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
+    function->stackSlots = 0;
     function->name = NULL;
+    function->lazyBody = NULL;
     initChunk(&function->chunk);
     return function;
 }
@@ -79,15 +97,16 @@ ObjNative* newNative(NativeFn function)
     return native;
 }
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash)
+static StringSet* internSet()
 {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-    string->length = length;
-    string->chars = chars;
-    string->hash = hash;
-    pushValue(OBJ_VAL(string));
-    tableSet(&vm.strings, string, NIL_VAL);
-    popValue();
+    return localHeap != NULL ? &localHeap->strings : &vm.strings;
+}
+
+static ObjString* intern(ObjString* string)
+{
+    pushRoot(OBJ_VAL(string));
+    stringSetAdd(internSet(), string);
+    popRoot();
     return string;
 }
 
@@ -102,31 +121,54 @@ static uint32_t hashString(const char* key, int length)
     return hash;
 }
 
-ObjString* takeString(char* chars, int length)
+/*
+ * A string with room for 'length' characters, for the caller to fill in
+ * and pass to finishString() before anything else can see it.
+ */
+ObjString* newString(int length)
 {
-    uint32_t hash = hashString(chars, length);
+    ObjString* string = (ObjString*)allocateObject(sizeof(ObjString) + length + 1, OBJ_STRING);
+    string->length = length;
+    string->chars[length] = '\0';
+    return string;
+}
 
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
-    if (interned != NULL)
-    {
-        FREE_ARRAY(char, chars, length + 1);
-        return interned;
-    }
+/*
+ * Hashes and interns a string from newString(). If an equal one was
+ * interned already, that one is returned instead, and 'string' is left
+ * for the collector.
+ */
+ObjString* finishString(ObjString* string)
+{
+    string->hash = hashString(string->chars, string->length);
+
+    ObjString* interned = stringSetFind(internSet(), string->chars, string->length, string->hash);
+    if (interned != NULL) return interned;
 
-    return allocateString(chars, length, hash);
+    return intern(string);
+}
+
+/*
+ * Like copyString(), but frees 'chars', which the caller allocated.
+ */
+ObjString* takeString(char* chars, int length)
+{
+    ObjString* string = copyString(chars, length);
+    FREE_ARRAY(char, chars, length + 1);
+    return string;
 }
 
 ObjString* copyString(const char* chars, int length)
 {
     uint32_t hash = hashString(chars, length);
     
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = stringSetFind(internSet(), chars, length, hash);
     if(interned != NULL) return interned;
 
-    char* heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    ObjString* string = newString(length);
+    memcpy(string->chars, chars, length);
+    string->hash = hash;
+    return intern(string);
 }
 
 ObjUpvalue* newUpvalue(Value* slot)
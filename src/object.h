@@ -37,11 +37,15 @@ typedef enum
 	OBJ_UPVALUE
 } ObjType;
 
+// The header is a single 32-bit word, so a 4-byte field can follow it in
+// the same 8 bytes. Marks are kept in bitmaps next to the objects (see
+// pool.h), and the heap is walked by page rather than through the objects.
 struct Obj
 {
-	ObjType type;
-	bool isMarked;
-	struct Obj* next;
+	unsigned int type : 8;			// an ObjType
+	unsigned int isYoung : 1;		// lives in the nursery (see memory.c)
+	unsigned int isRemembered : 1;	// in vm.remembered
+	unsigned int isForwarded : 1;	// moved by a collection: its first pointer-sized field points at the copy
 };
 
 typedef struct
@@ -49,8 +53,10 @@ typedef struct
 	Obj obj;
 	int arity;
 	int upvalueCount;
+	int stackSlots;				// most locals live at once, including slot zero
 	Chunk chunk;
 	ObjString* name;
+	struct LazyBody* lazyBody;	// body still to be compiled, NULL once it is (see compiler.c)
 } ObjFunction;
 
 typedef Value (*NativeFn)(int argCount, Value* args);
@@ -61,12 +67,14 @@ typedef struct
 	NativeFn function;
 } ObjNative;
 
+// Strings and closures are as long as their payload, which follows the
+// fields inline.
 struct ObjString 
 {
 	Obj obj;
 	int length;
-	char* chars;
 	uint32_t hash;
+	char chars[];				// 'length' characters and a terminating '\0'
 };
 
 typedef struct ObjUpvalue
@@ -80,9 +88,9 @@ typedef struct ObjUpvalue
 typedef struct
 {
 	Obj obj;
-	ObjFunction* function;
-	ObjUpvalue** upvalues;
 	int upvalueCount;
+	ObjFunction* function;
+	ObjUpvalue* upvalues[];		// 'upvalueCount' of them
 } ObjClosure;
 
 typedef struct {
@@ -109,6 +117,8 @@ ObjClosure* newClosure(ObjFunction* function);
 ObjFunction* newFunction();
 ObjInstance* newInstance(ObjClass* klass);
 ObjNative* newNative(NativeFn function);
+ObjString* newString(int length);
+ObjString* finishString(ObjString* string);
 ObjString* takeString(char* chars, int length);
 ObjString* copyString(const char*, int length);
 ObjUpvalue* newUpvalue(Value* slot);
@@ -0,0 +1,367 @@
+// For madvise(), which isn't POSIX and is left out under -std=c11.
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "pool.h"
+
+// Slots start this far into their page, after the header.
+#define PAGE_HEADER_SIZE ((sizeof(PoolPage) + 15) & ~(size_t)15)
+
+_Static_assert(POOL_SMALL_SIZE == 1 << 7 && POOL_STEPS == 1 << 2, "sizeClassOf() assumes these");
+_Static_assert(POOL_MAX_SIZE == POOL_SMALL_SIZE << 7, "POOL_HUGE_CLASS assumes this");
+
+static SizeClass* classFor(Pool* pool, size_t size)
+{
+    return &pool->classes[sizeClassOf(size)];
+}
+
+static size_t slotsPerPage(size_t slotSize)
+{
+    return (POOL_PAGE_SIZE - PAGE_HEADER_SIZE) / slotSize;
+}
+
+/*
+ * Starts a new newest page for 'sizeClass', reusing a released one if
+ * there is one.
+ */
+static void newPage(Pool* pool, SizeClass* sizeClass, size_t slotSize)
+{
+    PoolPage* page = pool->emptyPages;
+    if (page != NULL)
+    {
+        pool->emptyPages = page->next;
+    }
+    else
+    {
+        page = (PoolPage*)aligned_alloc(POOL_PAGE_SIZE, POOL_PAGE_SIZE);
+        if (page == NULL) exit(1); // Alloc fail. Can't recover.
+    }
+
+    page->next = sizeClass->pages;
+    page->slotSize = slotSize;
+    page->needsSweep = false;
+    memset(page->allocated, 0, sizeof(page->allocated));
+    memset(page->marks, 0, sizeof(page->marks));
+    sizeClass->pages = page;
+    sizeClass->top = (uint8_t*)page + PAGE_HEADER_SIZE;
+    sizeClass->end = sizeClass->top + slotsPerPage(slotSize) * slotSize;
+}
+
+void initPool(Pool* pool)
+{
+    for (int i = 0; i < POOL_CLASS_COUNT; i++)
+    {
+        pool->classes[i].freeSlots = NULL;
+        pool->classes[i].pages = NULL;
+        pool->classes[i].top = NULL;
+        pool->classes[i].end = NULL;
+    }
+    pool->evacuated = NULL;
+    pool->emptyPages = NULL;
+}
+
+/*
+ * A page of its own for an object past POOL_MAX_SIZE, with a single slot
+ * that takes up the rest of it.
+ */
+static void* allocateHuge(Pool* pool, size_t size)
+{
+    size_t bytes = (PAGE_HEADER_SIZE + size + POOL_PAGE_SIZE - 1) / POOL_PAGE_SIZE * POOL_PAGE_SIZE;
+    PoolPage* page = (PoolPage*)aligned_alloc(POOL_PAGE_SIZE, bytes);
+    if (page == NULL) exit(1); // Alloc fail. Can't recover.
+
+    SizeClass* sizeClass = &pool->classes[POOL_HUGE_CLASS];
+    page->next = sizeClass->pages;
+    page->slotSize = bytes - PAGE_HEADER_SIZE;
+    page->needsSweep = false;
+    memset(page->allocated, 0, sizeof(page->allocated));
+    memset(page->marks, 0, sizeof(page->marks));
+    sizeClass->pages = page;
+    return (uint8_t*)page + PAGE_HEADER_SIZE;
+}
+
+/*
+ * Takes a slot of at least 'size' bytes: a freed one if there is one,
+ * otherwise the next one of the newest page.
+ */
+void* poolAllocate(Pool* pool, size_t size)
+{
+    int index = sizeClassOf(size);
+    SizeClass* sizeClass = &pool->classes[index];
+    void* slot = sizeClass->freeSlots;
+    if (index == POOL_HUGE_CLASS)
+    {
+        slot = allocateHuge(pool, size);
+    }
+    else if (slot != NULL)
+    {
+        sizeClass->freeSlots = *(void**)slot;
+    }
+    else
+    {
+        size_t slotSize = classSlotSize(index);
+        if (sizeClass->top == sizeClass->end) newPage(pool, sizeClass, slotSize);
+        slot = sizeClass->top;
+        sizeClass->top += slotSize;
+    }
+
+    PoolPage* page = pageOf(slot);
+    setBit(page->allocated, granuleOf(page, slot));
+    return slot;
+}
+
+void poolFree(Pool* pool, void* slot, size_t size)
+{
+    PoolPage* page = pageOf(slot);
+    clearBit(page->allocated, granuleOf(page, slot));
+
+#ifdef DEBUG_STRESS_GC
+    memset(slot, 0xdb, size); // so stale references show up
+#endif
+
+    // Its page goes at the end of the sweep (see poolFreeHuge()).
+    if (sizeClassOf(size) == POOL_HUGE_CLASS) return;
+
+    SizeClass* sizeClass = classFor(pool, size);
+    *(void**)slot = sizeClass->freeSlots;
+    sizeClass->freeSlots = slot;
+}
+
+/*
+ * Moves every page of 'from' into 'pool'. The rest of the newest page of
+ * 'from' is freed slot by slot, since 'pool' already has a newest page.
+ */
+void mergePool(Pool* pool, Pool* from)
+{
+    for (int i = 0; i < POOL_CLASS_COUNT; i++)
+    {
+        SizeClass* into = &pool->classes[i];
+        SizeClass* sizeClass = &from->classes[i];
+        if (sizeClass->pages == NULL) continue;
+
+        size_t slotSize = sizeClass->pages->slotSize;
+        for (uint8_t* slot = sizeClass->top; slot < sizeClass->end; slot += slotSize)
+        {
+            *(void**)slot = sizeClass->freeSlots;
+            sizeClass->freeSlots = slot;
+        }
+
+        PoolPage* last = sizeClass->pages;
+        while (last->next != NULL) last = last->next;
+        if (into->pages == NULL)
+        {
+            into->pages = sizeClass->pages;
+        }
+        else
+        {
+            // Behind the newest page, which 'into' still carves slots from.
+            last->next = into->pages->next;
+            into->pages->next = sizeClass->pages;
+        }
+
+        void** lastFree = &sizeClass->freeSlots;
+        while (*lastFree != NULL) lastFree = (void**)*lastFree;
+        *lastFree = into->freeSlots;
+        into->freeSlots = sizeClass->freeSlots;
+    }
+    initPool(from);
+}
+
+static int liveSlots(PoolPage* page)
+{
+    int count = 0;
+    for (int i = 0; i < POOL_BITMAP_WORDS; i++)
+    {
+        count += __builtin_popcountll(page->allocated[i]);
+    }
+    return count;
+}
+
+/*
+ * Bytes of slots in use, and bytes of pages holding them.
+ */
+void poolUsage(Pool* pool, size_t* used, size_t* reserved)
+{
+    *used = 0;
+    *reserved = 0;
+    for (int i = 0; i < POOL_CLASS_COUNT; i++)
+    {
+        for (PoolPage* page = pool->classes[i].pages; page != NULL; page = page->next)
+        {
+            *used += (size_t)liveSlots(page) * page->slotSize;
+            *reserved += i == POOL_HUGE_CLASS ? PAGE_HEADER_SIZE + page->slotSize : POOL_PAGE_SIZE;
+        }
+    }
+}
+
+typedef struct
+{
+    PoolPage* page;
+    int live;
+} PageUsage;
+
+static int byLiveDescending(const void* a, const void* b)
+{
+    return ((const PageUsage*)b)->live - ((const PageUsage*)a)->live;
+}
+
+/*
+ * Makes 'page' the newest page of 'sizeClass' and puts its unused slots
+ * on the free list.
+ */
+static void keepPage(SizeClass* sizeClass, PoolPage* page)
+{
+    page->next = sizeClass->pages;
+    sizeClass->pages = page;
+
+    uint8_t* first = (uint8_t*)page + PAGE_HEADER_SIZE;
+    for (size_t i = slotsPerPage(page->slotSize); i-- > 0;)
+    {
+        uint8_t* slot = first + i * page->slotSize;
+        if (testBit(page->allocated, granuleOf(page, slot))) continue;
+
+        *(void**)slot = sizeClass->freeSlots;
+        sizeClass->freeSlots = slot;
+    }
+}
+
+/*
+ * Packs each size class but the huge one onto as few pages as its slots in use fit on: the
+ * fullest pages stay, and every slot in use on the others is moved to one
+ * of their free slots by 'move'. The pages emptied that way are taken out
+ * of the pool, but keep the old slots until poolReleaseEvacuated(), so
+ * the caller can still follow them to where they went. Returns how many
+ * pages were emptied.
+ */
+int poolEvacuate(Pool* pool, void (*move)(void* from, void* to))
+{
+    int emptied = 0;
+    for (int i = 0; i < POOL_HUGE_CLASS; i++)
+    {
+        SizeClass* sizeClass = &pool->classes[i];
+        int pageCount = 0;
+        for (PoolPage* page = sizeClass->pages; page != NULL; page = page->next) pageCount++;
+        if (pageCount < 2) continue;
+
+        PageUsage* usage = (PageUsage*)malloc(sizeof(PageUsage) * pageCount);
+        if (usage == NULL) exit(1); // Alloc fail. Can't recover.
+
+        int live = 0;
+        int count = 0;
+        for (PoolPage* page = sizeClass->pages; page != NULL; page = page->next)
+        {
+            usage[count].page = page;
+            usage[count].live = liveSlots(page);
+            live += usage[count++].live;
+        }
+
+        size_t slotSize = sizeClass->pages->slotSize;
+        int perPage = (int)slotsPerPage(slotSize);
+        int keep = (live + perPage - 1) / perPage;
+        if (keep == pageCount)
+        {
+            free(usage);
+            continue;
+        }
+
+        qsort(usage, pageCount, sizeof(PageUsage), byLiveDescending);
+        sizeClass->freeSlots = NULL;
+        sizeClass->pages = NULL;
+        sizeClass->top = NULL;
+        sizeClass->end = NULL;
+        for (int j = keep - 1; j >= 0; j--) keepPage(sizeClass, usage[j].page);
+
+        // The kept pages have at least as many free slots as the others
+        // have slots in use.
+        for (int j = keep; j < pageCount; j++)
+        {
+            PoolPage* page = usage[j].page;
+            for (int word = 0; word < POOL_BITMAP_WORDS; word++)
+            {
+                uint64_t allocated = page->allocated[word];
+                while (allocated != 0)
+                {
+                    int bit = __builtin_ctzll(allocated);
+                    allocated &= allocated - 1;
+                    move(slotAt(page, (size_t)word * 64 + bit), poolAllocate(pool, slotSize));
+                }
+            }
+            page->next = pool->evacuated;
+            pool->evacuated = page;
+            emptied++;
+        }
+        free(usage);
+    }
+    return emptied;
+}
+
+/*
+ * Gives the memory of the pages poolEvacuate() emptied back to the OS.
+ * Their headers stay, so they can be reused later on.
+ */
+void poolReleaseEvacuated(Pool* pool)
+{
+    while (pool->evacuated != NULL)
+    {
+        PoolPage* page = pool->evacuated;
+        pool->evacuated = page->next;
+
+#ifdef DEBUG_STRESS_GC
+        // Make anything still pointing at the old slots fail loudly.
+        memset((uint8_t*)page + PAGE_HEADER_SIZE, 0xdb, POOL_PAGE_SIZE - PAGE_HEADER_SIZE);
+#else
+        uintptr_t osPage = (uintptr_t)sysconf(_SC_PAGESIZE);
+        uintptr_t start = ((uintptr_t)page + PAGE_HEADER_SIZE + osPage - 1) & ~(osPage - 1);
+        uintptr_t end = (uintptr_t)page + POOL_PAGE_SIZE;
+        if (start < end) madvise((void*)start, end - start, MADV_DONTNEED);
+#endif
+        page->next = pool->emptyPages;
+        pool->emptyPages = page;
+    }
+}
+
+/*
+ * Frees the pages of the huge class whose object was freed.
+ */
+void poolFreeHuge(Pool* pool)
+{
+    PoolPage** link = &pool->classes[POOL_HUGE_CLASS].pages;
+    while (*link != NULL)
+    {
+        PoolPage* page = *link;
+        if (liveSlots(page) > 0)
+        {
+            link = &page->next;
+            continue;
+        }
+        *link = page->next;
+        free(page);
+    }
+}
+
+static void freePages(PoolPage* page)
+{
+    while (page != NULL)
+    {
+        PoolPage* next = page->next;
+        free(page);
+        page = next;
+    }
+}
+
+void freePool(Pool* pool)
+{
+    for (int i = 0; i < POOL_CLASS_COUNT; i++)
+    {
+        freePages(pool->classes[i].pages);
+    }
+    freePages(pool->evacuated);
+    freePages(pool->emptyPages);
+    initPool(pool);
+}
@@ -0,0 +1,110 @@
+#ifndef clox_pool_h
+#define clox_pool_h
+
+#include "common.h"
+
+#define POOL_PAGE_SIZE (64 * 1024)
+#define POOL_GRANULE 8
+#define POOL_SMALL_SIZE 128			// Classes up to here are POOL_GRANULE apart
+#define POOL_SMALL_CLASSES (POOL_SMALL_SIZE / POOL_GRANULE)
+#define POOL_STEPS 4				// Classes per doubling past POOL_SMALL_SIZE
+#define POOL_MAX_SIZE (16 * 1024)
+#define POOL_HUGE_CLASS (POOL_SMALL_CLASSES + 7 * POOL_STEPS)	// Past POOL_MAX_SIZE
+#define POOL_CLASS_COUNT (POOL_HUGE_CLASS + 1)
+#define POOL_BITMAP_WORDS (POOL_PAGE_SIZE / POOL_GRANULE / 64)
+
+// Old objects live in pages of equally sized slots, one list of pages per
+// size class. A page is aligned to its size, so the page any slot is in
+// can be found by masking the slot's address. Its header keeps a bit per
+// POOL_GRANULE bytes of the page for the slots in use, and another for the
+// collector's marks, which leaves the pool the only list of objects there
+// is. Strings and closures carry their payload inline, so sizes vary: the
+// classes are POOL_GRANULE apart for small objects, and POOL_STEPS to a
+// doubling from there to POOL_MAX_SIZE. A bigger object gets a page of its
+// own in the huge class, as many POOL_PAGE_SIZE long as it takes, which
+// is freed once the object is.
+typedef struct PoolPage
+{
+	struct PoolPage* next;			// Next page of the same size class
+	size_t slotSize;
+	bool needsSweep;				// Holds objects the sweep in progress hasn't looked at
+	uint64_t allocated[POOL_BITMAP_WORDS];	// Set for the first granule of every slot in use
+	uint64_t marks[POOL_BITMAP_WORDS];		// Likewise for every object marked
+} PoolPage;
+
+typedef struct
+{
+	void* freeSlots;				// Freed slots, linked through their first word
+	PoolPage* pages;				// Every page of this class, newest first
+	uint8_t* top;					// First slot of the newest page never handed out
+	uint8_t* end;					// End of the newest page
+} SizeClass;
+
+typedef struct
+{
+	SizeClass classes[POOL_CLASS_COUNT];
+	PoolPage* evacuated;			// Pages poolEvacuate() emptied, not released yet
+	PoolPage* emptyPages;			// Released pages, reused before any new one
+} Pool;
+
+static inline int sizeClassOf(size_t size)
+{
+	if (size <= POOL_SMALL_SIZE) return (int)((size - 1) / POOL_GRANULE);
+	if (size > POOL_MAX_SIZE) return POOL_HUGE_CLASS;
+
+	int doubling = 63 - __builtin_clzll(size - 1);	// at least log2(POOL_SMALL_SIZE)
+	int step = (int)((size - 1) >> (doubling - 2)) & (POOL_STEPS - 1);
+	return POOL_SMALL_CLASSES + (doubling - 7) * POOL_STEPS + step;
+}
+
+// The slot size of a class below POOL_HUGE_CLASS.
+static inline size_t classSlotSize(int index)
+{
+	if (index < POOL_SMALL_CLASSES) return (size_t)(index + 1) * POOL_GRANULE;
+
+	size_t base = (size_t)POOL_SMALL_SIZE << ((index - POOL_SMALL_CLASSES) / POOL_STEPS);
+	return base + ((index - POOL_SMALL_CLASSES) % POOL_STEPS + 1) * (base / POOL_STEPS);
+}
+
+static inline PoolPage* pageOf(const void* slot)
+{
+	return (PoolPage*)((uintptr_t)slot & ~(uintptr_t)(POOL_PAGE_SIZE - 1));
+}
+
+static inline size_t granuleOf(const void* base, const void* slot)
+{
+	return (size_t)((const uint8_t*)slot - (const uint8_t*)base) / POOL_GRANULE;
+}
+
+static inline bool testBit(const uint64_t* bits, size_t index)
+{
+	return (bits[index / 64] >> (index % 64)) & 1;
+}
+
+static inline void setBit(uint64_t* bits, size_t index)
+{
+	bits[index / 64] |= (uint64_t)1 << (index % 64);
+}
+
+static inline void clearBit(uint64_t* bits, size_t index)
+{
+	bits[index / 64] &= ~((uint64_t)1 << (index % 64));
+}
+
+// The address of the slot at bit 'index' of a page's bitmaps.
+static inline void* slotAt(PoolPage* page, size_t index)
+{
+	return (uint8_t*)page + index * POOL_GRANULE;
+}
+
+void initPool(Pool* pool);
+void* poolAllocate(Pool* pool, size_t size);
+void poolFree(Pool* pool, void* slot, size_t size);
+void mergePool(Pool* pool, Pool* from);
+void poolUsage(Pool* pool, size_t* used, size_t* reserved);
+int poolEvacuate(Pool* pool, void (*move)(void* from, void* to));
+void poolReleaseEvacuated(Pool* pool);
+void poolFreeHuge(Pool* pool);
+void freePool(Pool* pool);
+
+#endif
@@ -5,75 +5,66 @@
 #include "common.h"
 #include "scanner.h"
 
-typedef struct 
+static bool isAtEnd(Scanner* scanner)
 {
-    const char* start_current_lexeme;	// points to char in source code (starting char of current lexeme being scanned)
-    const char* current_pos;		// points to current position in source code
-    int current_src_code_line;		// src code line nr where current lexeme is in
-} Scanner;
-
-static Scanner scanner; // TODO: global var no good (quick fixed with static but still bad)
-
-static bool isAtEnd()
-{
-    return *scanner.current_pos == '\0';
+    return *scanner->current_pos == '\0';
 }
 
-static Token makeToken(TokenType type)
+static Token makeToken(Scanner* scanner, TokenType type)
 {
     Token token;
     token.type = type;
-    token.lexeme_start = scanner.start_current_lexeme;
-    token.lexeme_length = (int)(scanner.current_pos - scanner.start_current_lexeme);
-    token.src_code_line = scanner.current_src_code_line;
+    token.lexeme_start = scanner->start_current_lexeme;
+    token.lexeme_length = (int)(scanner->current_pos - scanner->start_current_lexeme);
+    token.src_code_line = scanner->current_src_code_line;
     return token;
 }
 
-static Token errorToken(const char* message)
+static Token errorToken(Scanner* scanner, const char* message)
 {
     Token token;
     token.type = TOKEN_ERROR;
     token.lexeme_start = message;
     token.lexeme_length = (int)strlen(message);
-    token.src_code_line = scanner.current_src_code_line;
+    token.src_code_line = scanner->current_src_code_line;
     return token;
 }
 
-static char advance()
+static char advance(Scanner* scanner)
 {
-    return *scanner.current_pos++;
+    return *scanner->current_pos++;
 }
 
-static bool match(const char expected)
+static bool match(Scanner* scanner, const char expected)
 {
-    if (isAtEnd()) return false;
-    if (*scanner.current_pos != expected) return false;
-    scanner.current_pos++;
+    if (isAtEnd(scanner)) return false;
+    if (*scanner->current_pos != expected) return false;
+    scanner->current_pos++;
     return true;
 }
 
-static void skipWhiteSpaceAndComments()
+static void skipWhiteSpaceAndComments(Scanner* scanner)
 {
     while(1) {
-	char c = *scanner.current_pos;
+	char c = *scanner->current_pos;
 	switch (c) {
 	    // whitespace
 	    case ' ':
 	    case '\r':
 	    case '\t':
-		advance();
+		advance(scanner);
 		break;
 	    // newline
 	    case '\n':
-		scanner.current_src_code_line++;
-		advance();
+		scanner->current_src_code_line++;
+		advance(scanner);
 		break;
 	    // comment
 	    case '/':
-		if (!isAtEnd() && scanner.current_pos[1] == '/')
+		if (!isAtEnd(scanner) && scanner->current_pos[1] == '/')
 		{
 		    // A comment goes until the end of the line.
-		    while (*scanner.current_pos != '\n' && !isAtEnd()) advance();
+		    while (*scanner->current_pos != '\n' && !isAtEnd(scanner)) advance(scanner);
 		} 
 		else return;
 		break;
@@ -83,18 +74,18 @@ static void skipWhiteSpaceAndComments()
     }
 }
 
-static Token string()
+static Token string(Scanner* scanner)
 {
-    while (*scanner.current_pos != '"' && !isAtEnd())
+    while (*scanner->current_pos != '"' && !isAtEnd(scanner))
     {
-	if (*scanner.current_pos == '\n') scanner.current_src_code_line++;
-	advance();
+	if (*scanner->current_pos == '\n') scanner->current_src_code_line++;
+	advance(scanner);
     }
 
-    if (isAtEnd()) return errorToken("Unterminated string.");
+    if (isAtEnd(scanner)) return errorToken(scanner, "Unterminated string.");
 
-    advance(); // closing quote
-    return makeToken(TOKEN_STRING);
+    advance(scanner); // closing quote
+    return makeToken(scanner, TOKEN_STRING);
 }
 
 static bool isDigit(char c)
@@ -109,33 +100,33 @@ static bool isAlpha(char c)
 	|| (c == '_'));
 }
 
-static char peekNext()
+static char peekNext(Scanner* scanner)
 {
-    if (isAtEnd()) return '\0';
-    return scanner.current_pos[1];
+    if (isAtEnd(scanner)) return '\0';
+    return scanner->current_pos[1];
 }
 
-static Token number()
+static Token number(Scanner* scanner)
 {
     // consume all whole numbers
-    while (isDigit(*scanner.current_pos)) advance();
+    while (isDigit(*scanner->current_pos)) advance(scanner);
 
     // Check for decimal fraction
-    if (*scanner.current_pos == '.' && isDigit(peekNext()))
+    if (*scanner->current_pos == '.' && isDigit(peekNext(scanner)))
     {
 	// consume decimal point
-	advance();
+	advance(scanner);
 	// and all fractional numbers
-	while (isDigit(*scanner.current_pos)) advance();
+	while (isDigit(*scanner->current_pos)) advance(scanner);
     }
     
-    return makeToken(TOKEN_NUMBER);
+    return makeToken(scanner, TOKEN_NUMBER);
 }
 
-static TokenType checkKeyword(int start, int length, const char* rest, TokenType type)
+static TokenType checkKeyword(Scanner* scanner, int start, int length, const char* rest, TokenType type)
 {
-    if (scanner.current_pos - scanner.start_current_lexeme == start + length
-	&& memcmp(scanner.start_current_lexeme + start, rest, length) == 0)
+    if (scanner->current_pos - scanner->start_current_lexeme == start + length
+	&& memcmp(scanner->start_current_lexeme + start, rest, length) == 0)
     {
 	return type;
     }
@@ -143,93 +134,102 @@ static TokenType checkKeyword(int start, int length, const char* rest, TokenType
     return TOKEN_IDENTIFIER;
 }
 
-static TokenType identifierType()
+static TokenType identifierType(Scanner* scanner)
 {
-    char firstChar = *scanner.start_current_lexeme;
+    char firstChar = *scanner->start_current_lexeme;
     switch (firstChar)
     {
-	case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-	case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-	case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
+	case 'a': return checkKeyword(scanner, 1, 2, "nd", TOKEN_AND);
+	case 'c': return checkKeyword(scanner, 1, 4, "lass", TOKEN_CLASS);
+	case 'e': return checkKeyword(scanner, 1, 3, "lse", TOKEN_ELSE);
 	case 'f':
-	    if (scanner.current_pos - scanner.start_current_lexeme > 1)
+	    if (scanner->current_pos - scanner->start_current_lexeme > 1)
+	    {
+		switch (scanner->start_current_lexeme[1]) 
+		{
+		    case 'a': return checkKeyword(scanner, 2, 3, "lse", TOKEN_FALSE);
+		    case 'o': return checkKeyword(scanner, 2, 1, "r", TOKEN_FOR);
+		    case 'u': return checkKeyword(scanner, 2, 1, "n", TOKEN_FUN);
+		}
+	    }
+	    break;
+	case 'i':
+	    if (scanner->current_pos - scanner->start_current_lexeme > 1)
 	    {
-		switch (scanner.start_current_lexeme[1]) 
+		switch (scanner->start_current_lexeme[1]) 
 		{
-		    case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-		    case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-		    case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
+		    case 'f': return checkKeyword(scanner, 2, 0, "", TOKEN_IF);
+		    case 'm': return checkKeyword(scanner, 2, 4, "port", TOKEN_IMPORT);
 		}
 	    }
 	    break;
-	case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-	case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-	case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-	case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-	case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-	case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
+	case 'n': return checkKeyword(scanner, 1, 2, "il", TOKEN_NIL);
+	case 'o': return checkKeyword(scanner, 1, 1, "r", TOKEN_OR);
+	case 'p': return checkKeyword(scanner, 1, 4, "rint", TOKEN_PRINT);
+	case 'r': return checkKeyword(scanner, 1, 5, "eturn", TOKEN_RETURN);
+	case 's': return checkKeyword(scanner, 1, 4, "uper", TOKEN_SUPER);
 	case 't':
-	    if (scanner.current_pos - scanner.start_current_lexeme > 1)
+	    if (scanner->current_pos - scanner->start_current_lexeme > 1)
 	    {
-		switch (scanner.start_current_lexeme[1]) 
+		switch (scanner->start_current_lexeme[1]) 
 		{
-		    case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-		    case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
+		    case 'h': return checkKeyword(scanner, 2, 2, "is", TOKEN_THIS);
+		    case 'r': return checkKeyword(scanner, 2, 2, "ue", TOKEN_TRUE);
 		}
 	    }
 	    break;
-	case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-	case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+	case 'v': return checkKeyword(scanner, 1, 2, "ar", TOKEN_VAR);
+	case 'w': return checkKeyword(scanner, 1, 4, "hile", TOKEN_WHILE);
     }
     return TOKEN_IDENTIFIER;
 }
 
-static Token identifier()
+static Token identifier(Scanner* scanner)
 {
-    while (isAlpha(*scanner.current_pos)) advance();
-    return makeToken(identifierType());
+    while (isAlpha(*scanner->current_pos)) advance(scanner);
+    return makeToken(scanner, identifierType(scanner));
 }
 
-void initScanner(const char* source)
+void initScanner(Scanner* scanner, const char* source, int line)
 {
-    scanner.start_current_lexeme = source;
-    scanner.current_pos = source;
-    scanner.current_src_code_line = 1;
+    scanner->start_current_lexeme = source;
+    scanner->current_pos = source;
+    scanner->current_src_code_line = line;
 }
 
-Token scanToken()
+Token scanToken(Scanner* scanner)
 {
-    skipWhiteSpaceAndComments();
-    scanner.start_current_lexeme = scanner.current_pos;
+    skipWhiteSpaceAndComments(scanner);
+    scanner->start_current_lexeme = scanner->current_pos;
 
-    if (isAtEnd()) return makeToken(TOKEN_EOF);
+    if (isAtEnd(scanner)) return makeToken(scanner, TOKEN_EOF);
 
-    char c = advance();
-    if (isAlpha(c)) return identifier();
-    if (isDigit(c)) return number();
+    char c = advance(scanner);
+    if (isAlpha(c)) return identifier(scanner);
+    if (isDigit(c)) return number(scanner);
 
     switch (c)
     {
 	// one-character tokens
-	case '(': return makeToken(TOKEN_LEFT_PAREN);
-	case ')': return makeToken(TOKEN_RIGHT_PAREN);
-	case '{': return makeToken(TOKEN_LEFT_BRACE);
-	case '}': return makeToken(TOKEN_RIGHT_BRACE);
-	case ';': return makeToken(TOKEN_SEMICOLON);
-	case ',': return makeToken(TOKEN_COMMA);
-	case '.': return makeToken(TOKEN_DOT);
-	case '-': return makeToken(TOKEN_MINUS);
-	case '+': return makeToken(TOKEN_PLUS);
-	case '/': return makeToken(TOKEN_SLASH);
-	case '*': return makeToken(TOKEN_STAR);
+	case '(': return makeToken(scanner, TOKEN_LEFT_PAREN);
+	case ')': return makeToken(scanner, TOKEN_RIGHT_PAREN);
+	case '{': return makeToken(scanner, TOKEN_LEFT_BRACE);
+	case '}': return makeToken(scanner, TOKEN_RIGHT_BRACE);
+	case ';': return makeToken(scanner, TOKEN_SEMICOLON);
+	case ',': return makeToken(scanner, TOKEN_COMMA);
+	case '.': return makeToken(scanner, TOKEN_DOT);
+	case '-': return makeToken(scanner, TOKEN_MINUS);
+	case '+': return makeToken(scanner, TOKEN_PLUS);
+	case '/': return makeToken(scanner, TOKEN_SLASH);
+	case '*': return makeToken(scanner, TOKEN_STAR);
 	// two-character tokens
-	case '!': return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
-	case '=': return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
-	case '<': return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
-	case '>': return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+	case '!': return makeToken(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+	case '=': return makeToken(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+	case '<': return makeToken(scanner, match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+	case '>': return makeToken(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
 	// strings
-	case '"': return string();
+	case '"': return string(scanner);
     }
 
-    return errorToken("Unexpected character.");
+    return errorToken(scanner, "Unexpected character.");
 }
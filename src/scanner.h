@@ -17,11 +17,11 @@ typedef enum
   TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER, // 19 - 21
   // Keywords.
   TOKEN_AND, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE, // 22 - 25
-  TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_NIL, TOKEN_OR, // 26 - 30
-  TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER, TOKEN_THIS, // 31 - 34
-  TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE, // 35 - 37
+  TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_IMPORT, TOKEN_NIL, TOKEN_OR, // 26 - 31
+  TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER, TOKEN_THIS, // 32 - 35
+  TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE, // 36 - 38
 
-  TOKEN_ERROR, TOKEN_EOF // 38 - 39
+  TOKEN_ERROR, TOKEN_EOF // 39 - 40
 } TokenType;
 
 typedef struct
@@ -32,7 +32,16 @@ typedef struct
 	int src_code_line;	  // src code line nr of where token appears
 } Token;
 
-void initScanner(const char* source);
-Token scanToken();
+// Each compile scans with its own scanner, so files can be compiled on
+// several threads at once.
+typedef struct 
+{
+	const char* start_current_lexeme;	// points to char in source code (starting char of current lexeme being scanned)
+	const char* current_pos;		// points to current position in source code
+	int current_src_code_line;		// src code line nr where current lexeme is in
+} Scanner;
+
+void initScanner(Scanner* scanner, const char* source, int line);
+Token scanToken(Scanner* scanner);
 
 #endif
@@ -0,0 +1,289 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "common.h"
+#include "object.h"
+#include "serial.h"
+#include "value.h"
+
+void initWriter(Writer* writer, FILE* file)
+{
+    writer->file = file;
+    writer->offset = 0;
+    writer->checksum = CHECKSUM_START;
+    writer->failed = file == NULL;
+}
+
+/*
+ * FNV-1a, which is plenty to tell a damaged file from the one written.
+ */
+uint32_t checksumBytes(uint32_t checksum, const void* bytes, size_t size)
+{
+    const uint8_t* byte = (const uint8_t*)bytes;
+    for (size_t i = 0; i < size; i++)
+    {
+        checksum ^= byte[i];
+        checksum *= 16777619u;
+    }
+    return checksum;
+}
+
+void writeBytes(Writer* writer, const void* bytes, size_t size)
+{
+    if (size == 0 || writer->failed) return;
+    if (fwrite(bytes, 1, size, writer->file) != size) writer->failed = true;
+    writer->offset += size;
+    writer->checksum = checksumBytes(writer->checksum, bytes, size);
+}
+
+void writeU8(Writer* writer, uint8_t value)
+{
+    writeBytes(writer, &value, sizeof(value));
+}
+
+void writeU32(Writer* writer, uint32_t value)
+{
+    writeBytes(writer, &value, sizeof(value));
+}
+
+void writeF64(Writer* writer, double value)
+{
+    writeBytes(writer, &value, sizeof(value));
+}
+
+/*
+ * Pads the output so the next write lands on an 'alignment' boundary,
+ * which lets a reader of a mapped file point at arrays in it directly.
+ */
+void writeAlign(Writer* writer, size_t alignment)
+{
+    static const uint8_t zeros[8] = {0};
+    size_t padding = (alignment - writer->offset % alignment) % alignment;
+    writeBytes(writer, zeros, padding);
+}
+
+void initReader(Reader* reader, const void* start, size_t size)
+{
+    reader->start = (const uint8_t*)start;
+    reader->pos = reader->start;
+    reader->end = reader->start + size;
+    reader->failed = false;
+}
+
+const uint8_t* readBytes(Reader* reader, size_t size)
+{
+    if (reader->failed || (size_t)(reader->end - reader->pos) < size)
+    {
+        reader->failed = true;
+        return NULL;
+    }
+    const uint8_t* bytes = reader->pos;
+    reader->pos += size;
+    return bytes;
+}
+
+uint8_t readU8(Reader* reader)
+{
+    const uint8_t* bytes = readBytes(reader, sizeof(uint8_t));
+    return bytes == NULL ? 0 : *bytes;
+}
+
+uint32_t readU32(Reader* reader)
+{
+    uint32_t value = 0;
+    const uint8_t* bytes = readBytes(reader, sizeof(value));
+    if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+double readF64(Reader* reader)
+{
+    double value = 0;
+    const uint8_t* bytes = readBytes(reader, sizeof(value));
+    if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+void readAlign(Reader* reader, size_t alignment)
+{
+    size_t offset = (size_t)(reader->pos - reader->start);
+    readBytes(reader, (alignment - offset % alignment) % alignment);
+}
+
+static uint32_t operandAt(const uint8_t* code, int offset, int size)
+{
+    uint32_t operand = 0;
+    for (int i = 0; i < size; i++) operand = (operand << 8) | code[offset + i];
+    return operand;
+}
+
+/*
+ * Checks that the bytecode of a function loaded from an image or a
+ * snapshot can't read or jump outside its chunk, on top of the checksum:
+ * each operand fits, constants, locals and upvalues exist and the
+ * constants have the type the instruction needs, and jumps land on an
+ * instruction. The compiler ends every chunk with OP_RETURN, so execution
+ * can't fall off the end either.
+ */
+bool verifyCode(ObjFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+    const uint8_t* code = chunk->code;
+    int count = chunk->count;
+    if (count == 0 || code[count - 1] != OP_RETURN) return false;
+
+    // One byte per offset: whether an instruction starts there, and
+    // whether a jump goes there.
+    uint8_t* starts = (uint8_t*)calloc((size_t)count, 1);
+    if (starts == NULL) exit(1);
+
+    bool valid = true;
+    for (int offset = 0; offset < count && valid;)
+    {
+        uint8_t instruction = code[offset];
+        starts[offset] |= 1;
+
+        // The operands: an optional constant, a slot, a jump offset or
+        // an argument count, with the widths the vm reads them in.
+        int constantSize = 0;
+        bool wantsString = true;
+        int slotSize = 0;
+        int slotLimit = 0;
+        int jumpSize = 0;
+        int jumpSign = 1;
+        int trailing = 0;
+        switch (instruction)
+        {
+            case OP_CLASS:
+            case OP_DEFINE_GLOBAL:
+            case OP_GET_GLOBAL:
+            case OP_GET_PROPERTY:
+            case OP_GET_SUPER:
+            case OP_IMPORT:
+            case OP_METHOD:
+            case OP_SET_GLOBAL:
+            case OP_SET_PROPERTY:
+                constantSize = 1;
+                break;
+            case OP_CLASS_LONG:
+            case OP_DEFINE_GLOBAL_LONG:
+            case OP_GET_GLOBAL_LONG:
+            case OP_GET_PROPERTY_LONG:
+            case OP_GET_SUPER_LONG:
+            case OP_IMPORT_LONG:
+            case OP_METHOD_LONG:
+            case OP_SET_GLOBAL_LONG:
+            case OP_SET_PROPERTY_LONG:
+                constantSize = 3;
+                break;
+            case OP_INVOKE:
+            case OP_SUPER_INVOKE:
+                constantSize = 1;
+                trailing = 1;
+                break;
+            case OP_INVOKE_LONG:
+            case OP_SUPER_INVOKE_LONG:
+                constantSize = 3;
+                trailing = 1;
+                break;
+            case OP_CONSTANT:
+            case OP_CONSTANT_LONG:
+            case OP_CLOSURE:
+            case OP_CLOSURE_LONG:
+                constantSize = instruction == OP_CONSTANT || instruction == OP_CLOSURE ? 1 : 3;
+                wantsString = false;
+                break;
+            case OP_CALL:
+                trailing = 1;
+                break;
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+            case OP_GET_LOCAL_LONG:
+            case OP_SET_LOCAL_LONG:
+                slotSize = instruction == OP_GET_LOCAL || instruction == OP_SET_LOCAL ? 1 : 2;
+                slotLimit = function->stackSlots;
+                break;
+            case OP_GET_UPVALUE:
+            case OP_SET_UPVALUE:
+                slotSize = 1;
+                slotLimit = function->upvalueCount;
+                break;
+            case OP_LOOP:
+            case OP_LOOP_LONG:
+                jumpSign = -1;
+                // Fall through.
+            case OP_JUMP:
+            case OP_JUMP_LONG:
+            case OP_JUMP_IF_EQUAL:
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_GREATER:
+            case OP_JUMP_IF_LESS:
+            case OP_JUMP_IF_NOT_EQUAL:
+            case OP_JUMP_IF_NOT_GREATER:
+            case OP_JUMP_IF_NOT_LESS:
+                jumpSize = instruction == OP_JUMP_LONG || instruction == OP_LOOP_LONG ? 4 : 2;
+                break;
+            default:
+                valid = instruction <= OP_TRUE;
+        }
+
+        int next = offset + 1 + constantSize + slotSize + jumpSize + trailing;
+        if (!valid || next > count)
+        {
+            valid = false;
+            break;
+        }
+
+        if (constantSize > 0)
+        {
+            uint32_t constant = operandAt(code, offset + 1, constantSize);
+            if (constant >= (uint32_t)chunk->constants.count)
+            {
+                valid = false;
+                break;
+            }
+
+            Value value = chunk->constants.values[constant];
+            if (wantsString && !IS_STRING(value)) valid = false;
+            if (instruction == OP_CLOSURE || instruction == OP_CLOSURE_LONG)
+            {
+                // Each upvalue is captured from a local or an upvalue of
+                // this function.
+                if (!IS_FUNCTION(value))
+                {
+                    valid = false;
+                    break;
+                }
+                for (int i = 0; i < AS_FUNCTION(value)->upvalueCount && valid; i++)
+                {
+                    if (next + 3 > count)
+                    {
+                        valid = false;
+                        break;
+                    }
+                    int limit = code[next] ? function->stackSlots : function->upvalueCount;
+                    valid = operandAt(code, next + 1, 2) < (uint32_t)limit;
+                    next += 3;
+                }
+            }
+        }
+        if (slotSize > 0 && operandAt(code, offset + 1, slotSize) >= (uint32_t)slotLimit) valid = false;
+        if (jumpSize > 0)
+        {
+            long long target = next + jumpSign * (long long)operandAt(code, offset + 1, jumpSize);
+            if (target < 0 || target >= count) valid = false;
+            else starts[target] |= 2;
+        }
+        offset = next;
+    }
+
+    for (int offset = 0; offset < count && valid; offset++)
+    {
+        if (starts[offset] == 2) valid = false;
+    }
+    free(starts);
+    return valid;
+}
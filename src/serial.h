@@ -0,0 +1,49 @@
+#ifndef clox_serial_h
+#define clox_serial_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+
+// Helpers for the on-disk formats (bytecode images and heap snapshots).
+// Values are written in host byte order; formats guard against foreign
+// files with a byte order mark in their header.
+
+#define CHECKSUM_START 2166136261u
+
+typedef struct
+{
+	FILE* file;
+	size_t offset;			// nr of bytes written so far
+	uint32_t checksum;		// of the bytes written since it was last set to CHECKSUM_START
+	bool failed;			// set on the first failed write, later writes are skipped
+} Writer;
+
+typedef struct
+{
+	const uint8_t* start;
+	const uint8_t* pos;
+	const uint8_t* end;
+	bool failed;			// set when reading past the end, later reads return zeros
+} Reader;
+
+void initWriter(Writer* writer, FILE* file);
+void writeBytes(Writer* writer, const void* bytes, size_t size);
+void writeU8(Writer* writer, uint8_t value);
+void writeU32(Writer* writer, uint32_t value);
+void writeF64(Writer* writer, double value);
+void writeAlign(Writer* writer, size_t alignment);
+
+uint32_t checksumBytes(uint32_t checksum, const void* bytes, size_t size);
+
+void initReader(Reader* reader, const void* start, size_t size);
+const uint8_t* readBytes(Reader* reader, size_t size);
+uint8_t readU8(Reader* reader);
+uint32_t readU32(Reader* reader);
+double readF64(Reader* reader);
+void readAlign(Reader* reader, size_t alignment);
+
+bool verifyCode(ObjFunction* function);
+
+#endif
@@ -0,0 +1,703 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+#include "serial.h"
+#include "snapshot.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+
+// A snapshot holds everything reachable from the globals and the list of
+// imported modules, as a list of object records that refer to each other by index.
+// Strings are interned again as they're loaded, so the string table isn't part of it.
+// Loading allocates all objects first and then patches in the references,
+// which relocates every pointer to wherever its object ended up.
+#define SNAPSHOT_MAGIC "LOXS"
+#define SNAPSHOT_VERSION 6
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+
+typedef enum
+{
+    VALUE_NIL,
+    VALUE_FALSE,
+    VALUE_TRUE,
+    VALUE_NUMBER,
+    VALUE_OBJ,
+} ValueTag;
+
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t byteOrder;     // SNAPSHOT_BYTE_ORDER as written by the host
+    uint32_t objectCount;
+    uint32_t checksum;      // of everything after the header, see checksumBytes()
+} SnapshotHeader;
+
+// Numbers the objects of the heap in the order they're discovered.
+// 'objects' doubles as the work list while the heap is traversed.
+typedef struct
+{
+    Obj** objects;          // objects by index
+    int count;
+    int capacity;
+    Obj** keys;             // open addressing set of the objects...
+    int* indices;           // ...and their index
+    int keyCapacity;        // always a power of two
+} ObjectIndex;
+
+// Objects are loaded in passes: every object but closures gets allocated
+// first, then closures (which need their function's upvalue count), and
+// finally all references are filled in.
+typedef enum
+{
+    PASS_ALLOCATE,
+    PASS_ALLOCATE_CLOSURES,
+    PASS_LINK,
+} LoadPass;
+
+typedef struct
+{
+    Reader reader;
+    LoadPass pass;
+    Obj** objects;
+    uint32_t objectCount;
+} Loader;
+
+static void* checkedRealloc(void* pointer, size_t size)
+{
+    void* result = realloc(pointer, size);
+    if (result == NULL) exit(1);
+    return result;
+}
+
+static uint32_t hashPointer(Obj* object)
+{
+    return (uint32_t)(((uintptr_t)object >> 3) * 2654435761u);
+}
+
+static void growKeys(ObjectIndex* index)
+{
+    int capacity = NEW_ARRAY_CAPACITY(index->keyCapacity);
+    index->keys = (Obj**)checkedRealloc(NULL, sizeof(Obj*) * capacity);
+    index->indices = (int*)checkedRealloc(index->indices, sizeof(int) * capacity);
+    index->keyCapacity = capacity;
+
+    for (int i = 0; i < capacity; i++) index->keys[i] = NULL;
+    for (int i = 0; i < index->count; i++)
+    {
+        uint32_t slot = hashPointer(index->objects[i]) & (capacity - 1);
+        while (index->keys[slot] != NULL) slot = (slot + 1) & (capacity - 1);
+        index->keys[slot] = index->objects[i];
+        index->indices[slot] = i;
+    }
+}
+
+/*
+ * Returns the 1-based index of 'object', or 0 for NULL. Objects seen for
+ * the first time are appended so their references get visited later on.
+ */
+static uint32_t indexOf(ObjectIndex* index, Obj* object)
+{
+    if (object == NULL) return 0;
+
+    if (index->keyCapacity < (index->count + 1) * 2)
+    {
+        free(index->keys);
+        growKeys(index);
+    }
+
+    uint32_t slot = hashPointer(object) & (index->keyCapacity - 1);
+    while (index->keys[slot] != NULL)
+    {
+        if (index->keys[slot] == object) return (uint32_t)index->indices[slot] + 1;
+        slot = (slot + 1) & (index->keyCapacity - 1);
+    }
+
+    if (index->capacity < index->count + 1)
+    {
+        index->capacity = NEW_ARRAY_CAPACITY(index->capacity);
+        index->objects = (Obj**)checkedRealloc(index->objects, sizeof(Obj*) * index->capacity);
+    }
+
+    index->keys[slot] = object;
+    index->indices[slot] = index->count;
+    index->objects[index->count++] = object;
+    return (uint32_t)index->count;
+}
+
+static void indexValue(ObjectIndex* index, Value value)
+{
+    if (IS_OBJ(value)) indexOf(index, AS_OBJ(value));
+}
+
+static void indexTable(ObjectIndex* index, Table* table)
+{
+    for (int i = 0; i < table->capacity; i++)
+    {
+        if (!tableSlotInUse(table, i)) continue;
+        indexOf(index, (Obj*)tableKeys(table)[i]);
+        indexValue(index, tableValues(table)[i]);
+    }
+}
+
+static void indexReferences(ObjectIndex* index, Obj* object)
+{
+    switch (object->type)
+    {
+        case OBJ_BOUND_METHOD:
+        {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            indexValue(index, bound->receiver);
+            indexOf(index, (Obj*)bound->method);
+            break;
+        }
+        case OBJ_CLASS:
+        {
+            ObjClass* klass = (ObjClass*)object;
+            indexOf(index, (Obj*)klass->name);
+            indexTable(index, &klass->methods);
+            break;
+        }
+        case OBJ_CLOSURE:
+        {
+            ObjClosure* closure = (ObjClosure*)object;
+            indexOf(index, (Obj*)closure->function);
+            for (int i = 0; i < closure->upvalueCount; i++)
+            {
+                indexOf(index, (Obj*)closure->upvalues[i]);
+            }
+            break;
+        }
+        case OBJ_FUNCTION:
+        {
+            ObjFunction* function = (ObjFunction*)object;
+            indexOf(index, (Obj*)function->name);
+            for (int i = 0; i < function->chunk.constants.count; i++)
+            {
+                indexValue(index, function->chunk.constants.values[i]);
+            }
+            break;
+        }
+        case OBJ_INSTANCE:
+        {
+            ObjInstance* instance = (ObjInstance*)object;
+            indexOf(index, (Obj*)instance->klass);
+            indexTable(index, &instance->fields);
+            break;
+        }
+        case OBJ_NATIVE:
+        case OBJ_STRING:
+            break;
+        case OBJ_UPVALUE:
+            indexValue(index, ((ObjUpvalue*)object)->closed);
+            break;
+    }
+}
+
+static void writeRef(Writer* writer, ObjectIndex* index, Obj* object)
+{
+    writeU32(writer, indexOf(index, object));
+}
+
+static void writeValue(Writer* writer, ObjectIndex* index, Value value)
+{
+    if (IS_NIL(value))
+    {
+        writeU8(writer, VALUE_NIL);
+    }
+    else if (IS_BOOL(value))
+    {
+        writeU8(writer, AS_BOOL(value) ? VALUE_TRUE : VALUE_FALSE);
+    }
+    else if (IS_NUMBER(value))
+    {
+        writeU8(writer, VALUE_NUMBER);
+        writeF64(writer, AS_NUMBER(value));
+    }
+    else
+    {
+        writeU8(writer, VALUE_OBJ);
+        writeRef(writer, index, AS_OBJ(value));
+    }
+}
+
+static void writeTable(Writer* writer, ObjectIndex* index, Table* table)
+{
+    uint32_t count = 0;
+    for (int i = 0; i < table->capacity; i++)
+    {
+        if (tableSlotInUse(table, i)) count++;
+    }
+
+    writeU32(writer, count);
+    for (int i = 0; i < table->capacity; i++)
+    {
+        if (!tableSlotInUse(table, i)) continue;
+        writeRef(writer, index, (Obj*)tableKeys(table)[i]);
+        writeValue(writer, index, tableValues(table)[i]);
+    }
+}
+
+static void writeObject(Writer* writer, ObjectIndex* index, Obj* object)
+{
+    writeU8(writer, (uint8_t)object->type);
+
+    switch (object->type)
+    {
+        case OBJ_BOUND_METHOD:
+        {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            writeValue(writer, index, bound->receiver);
+            writeRef(writer, index, (Obj*)bound->method);
+            break;
+        }
+        case OBJ_CLASS:
+        {
+            ObjClass* klass = (ObjClass*)object;
+            writeRef(writer, index, (Obj*)klass->name);
+            writeTable(writer, index, &klass->methods);
+            break;
+        }
+        case OBJ_CLOSURE:
+        {
+            ObjClosure* closure = (ObjClosure*)object;
+            writeRef(writer, index, (Obj*)closure->function);
+            writeU32(writer, (uint32_t)closure->upvalueCount);
+            for (int i = 0; i < closure->upvalueCount; i++)
+            {
+                writeRef(writer, index, (Obj*)closure->upvalues[i]);
+            }
+            break;
+        }
+        case OBJ_FUNCTION:
+        {
+            ObjFunction* function = (ObjFunction*)object;
+            Chunk* chunk = &function->chunk;
+
+            // A lazy body would have to be compiled from a source that's
+            // long gone by the time the snapshot is loaded.
+            if (function->lazyBody != NULL) writer->failed = true;
+
+            writeU32(writer, (uint32_t)function->arity);
+            writeU32(writer, (uint32_t)function->upvalueCount);
+            writeU32(writer, (uint32_t)function->stackSlots);
+            writeRef(writer, index, (Obj*)function->name);
+            writeU32(writer, (uint32_t)chunk->count);
+            writeBytes(writer, chunk->code, chunk->count);
+            writeU32(writer, (uint32_t)chunk->lineCount);
+            writeBytes(writer, chunk->lines, sizeof(LineStart) * chunk->lineCount);
+            writeU32(writer, (uint32_t)chunk->constants.count);
+            for (int i = 0; i < chunk->constants.count; i++)
+            {
+                writeValue(writer, index, chunk->constants.values[i]);
+            }
+            break;
+        }
+        case OBJ_INSTANCE:
+        {
+            ObjInstance* instance = (ObjInstance*)object;
+            writeRef(writer, index, (Obj*)instance->klass);
+            writeTable(writer, index, &instance->fields);
+            break;
+        }
+        case OBJ_NATIVE:
+        {
+            int native = nativeIndex(((ObjNative*)object)->function);
+            if (native == -1) writer->failed = true;
+            writeU32(writer, (uint32_t)native);
+            break;
+        }
+        case OBJ_STRING:
+        {
+            ObjString* string = (ObjString*)object;
+            writeU32(writer, (uint32_t)string->length);
+            writeBytes(writer, string->chars, string->length);
+            break;
+        }
+        case OBJ_UPVALUE:
+            writeValue(writer, index, ((ObjUpvalue*)object)->closed);
+            break;
+    }
+}
+
+/*
+ * Writes the heap to 'path'. Only possible while no code is running, as
+ * the stack and open upvalues aren't part of a snapshot.
+ */
+bool writeSnapshot(const char* path)
+{
+    if (vm.frameCount != 0 || vm.openUpvalues != NULL) return false;
+
+    ObjectIndex index = {NULL, 0, 0, NULL, NULL, 0};
+    indexTable(&index, &vm.globals);
+    uint32_t moduleCount = 0;
+    for (int i = 0; i < vm.moduleCount; i++)
+    {
+        // Modules compiled ahead of time that never ran aren't saved.
+        if (vm.modules[i].function != NULL) continue;
+        indexOf(&index, (Obj*)vm.modules[i].path);
+        moduleCount++;
+    }
+    for (int i = 0; i < index.count; i++)
+    {
+        indexReferences(&index, index.objects[i]);
+    }
+
+    Writer writer;
+    initWriter(&writer, fopen(path, "wb"));
+
+    SnapshotHeader header;
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byteOrder = SNAPSHOT_BYTE_ORDER;
+    header.objectCount = (uint32_t)index.count;
+    header.checksum = 0;
+    writeBytes(&writer, &header, sizeof(header));
+    writer.checksum = CHECKSUM_START;
+
+    for (int i = 0; i < index.count; i++)
+    {
+        writeObject(&writer, &index, index.objects[i]);
+    }
+    writeTable(&writer, &index, &vm.globals);
+    writeU32(&writer, moduleCount);
+    for (int i = 0; i < vm.moduleCount; i++)
+    {
+        if (vm.modules[i].function != NULL) continue;
+        writeRef(&writer, &index, (Obj*)vm.modules[i].path);
+        writeU32(&writer, (uint32_t)vm.modules[i].hash);
+        writeU32(&writer, (uint32_t)(vm.modules[i].hash >> 32));
+    }
+
+    // The checksum is only known once the rest is written.
+    header.checksum = writer.checksum;
+    if (writer.file != NULL && fseek(writer.file, 0, SEEK_SET) != 0) writer.failed = true;
+    writeBytes(&writer, &header, sizeof(header));
+
+    if (writer.file != NULL && fclose(writer.file) != 0) writer.failed = true;
+    if (writer.failed) remove(path);
+
+    free(index.objects);
+    free(index.keys);
+    free(index.indices);
+    return !writer.failed;
+}
+
+/*
+ * Reads a reference and returns the object it points to once that exists,
+ * NULL before that. Fails the load on a dangling index or a wrong type.
+ */
+static Obj* readRef(Loader* loader, int type, bool nullable)
+{
+    uint32_t ref = readU32(&loader->reader);
+    if (ref == 0)
+    {
+        if (!nullable) loader->reader.failed = true;
+        return NULL;
+    }
+    if (ref > loader->objectCount)
+    {
+        loader->reader.failed = true;
+        return NULL;
+    }
+
+    Obj* object = loader->objects[ref - 1];
+    if (object == NULL) return NULL;
+    if (type != -1 && object->type != (ObjType)type)
+    {
+        loader->reader.failed = true;
+        return NULL;
+    }
+    return object;
+}
+
+static Value readValue(Loader* loader)
+{
+    switch (readU8(&loader->reader))
+    {
+        case VALUE_NIL:     return NIL_VAL;
+        case VALUE_FALSE:   return BOOL_VAL(false);
+        case VALUE_TRUE:    return BOOL_VAL(true);
+        case VALUE_NUMBER:  return NUMBER_VAL(readF64(&loader->reader));
+        case VALUE_OBJ:
+        {
+            Obj* object = readRef(loader, -1, false);
+            return object == NULL ? NIL_VAL : OBJ_VAL(object);
+        }
+        default:
+            loader->reader.failed = true;
+            return NIL_VAL;
+    }
+}
+
+/*
+ * Reads a table whose values are all objects of 'valueType', or anything
+ * for -1.
+ */
+static void readTable(Loader* loader, Table* table, int valueType)
+{
+    uint32_t count = readU32(&loader->reader);
+    for (uint32_t i = 0; i < count && !loader->reader.failed; i++)
+    {
+        ObjString* key = (ObjString*)readRef(loader, OBJ_STRING, false);
+        Value value = readValue(loader);
+        if (valueType != -1 && loader->pass == PASS_LINK && !isObjType(value, (ObjType)valueType))
+        {
+            loader->reader.failed = true;
+        }
+        if (loader->pass == PASS_LINK && key != NULL) tableSet(table, key, value);
+    }
+}
+
+static void readObject(Loader* loader, uint32_t i)
+{
+    Reader* reader = &loader->reader;
+    bool allocate = loader->pass == PASS_ALLOCATE;
+    bool link = loader->pass == PASS_LINK;
+    Obj* object = loader->objects[i];
+
+    ObjType type = (ObjType)readU8(reader);
+    switch (type)
+    {
+        case OBJ_BOUND_METHOD:
+        {
+            if (allocate) object = (Obj*)newBoundMethod(NIL_VAL, NULL);
+            Value receiver = readValue(loader);
+            Obj* method = readRef(loader, OBJ_CLOSURE, false);
+            if (link)
+            {
+                ((ObjBoundMethod*)object)->receiver = receiver;
+                ((ObjBoundMethod*)object)->method = (ObjClosure*)method;
+            }
+            break;
+        }
+        case OBJ_CLASS:
+        {
+            if (allocate) object = (Obj*)newClass(NULL);
+            Obj* name = readRef(loader, OBJ_STRING, false);
+            if (link) ((ObjClass*)object)->name = (ObjString*)name;
+            readTable(loader, &((ObjClass*)object)->methods, OBJ_CLOSURE);
+            break;
+        }
+        case OBJ_CLOSURE:
+        {
+            Obj* function = readRef(loader, OBJ_FUNCTION, false);
+            uint32_t upvalueCount = readU32(reader);
+            if (loader->pass == PASS_ALLOCATE_CLOSURES && function != NULL)
+            {
+                object = (Obj*)newClosure((ObjFunction*)function);
+                if (((ObjClosure*)object)->upvalueCount != (int)upvalueCount) reader->failed = true;
+            }
+
+            for (uint32_t j = 0; j < upvalueCount && !reader->failed; j++)
+            {
+                // Closures capture all their upvalues as they're created.
+                Obj* upvalue = readRef(loader, OBJ_UPVALUE, false);
+                if (link) ((ObjClosure*)object)->upvalues[j] = (ObjUpvalue*)upvalue;
+            }
+            break;
+        }
+        case OBJ_FUNCTION:
+        {
+            ObjFunction* function = allocate ? newFunction() : (ObjFunction*)object;
+            object = (Obj*)function;
+            uint32_t arity = readU32(reader);
+            uint32_t upvalueCount = readU32(reader);
+            uint32_t stackSlots = readU32(reader);
+            Obj* name = readRef(loader, OBJ_STRING, true);
+            uint32_t count = readU32(reader);
+            const uint8_t* code = readBytes(reader, count);
+            uint32_t lineCount = readU32(reader);
+            const uint8_t* lines = readBytes(reader, sizeof(LineStart) * (size_t)lineCount);
+            if (reader->failed || arity > UINT8_MAX || upvalueCount > UINT8_COUNT
+                || stackSlots > UINT16_COUNT || count > INT32_MAX || lineCount > count || lineCount == 0)
+            {
+                reader->failed = true;
+                break;
+            }
+
+            if (allocate)
+            {
+                Chunk* chunk = &function->chunk;
+                function->arity = (int)arity;
+                function->upvalueCount = (int)upvalueCount;
+                function->stackSlots = (int)stackSlots;
+                chunk->code = ALLOCATE(uint8_t, count);
+                chunk->lines = ALLOCATE(LineStart, lineCount);
+                memcpy(chunk->code, code, count);
+                memcpy(chunk->lines, lines, sizeof(LineStart) * lineCount);
+                chunk->count = chunk->capacity = (int)count;
+                chunk->lineCount = chunk->lineCapacity = (int)lineCount;
+            }
+
+            if (link) function->name = (ObjString*)name;
+            uint32_t constantCount = readU32(reader);
+            for (uint32_t j = 0; j < constantCount && !reader->failed; j++)
+            {
+                Value value = readValue(loader);
+                if (link) writeValueArray(&function->chunk.constants, value);
+            }
+            if (link) shrinkValueArray(&function->chunk.constants);
+            break;
+        }
+        case OBJ_INSTANCE:
+        {
+            if (allocate) object = (Obj*)newInstance(NULL);
+            Obj* klass = readRef(loader, OBJ_CLASS, false);
+            if (link) ((ObjInstance*)object)->klass = (ObjClass*)klass;
+            readTable(loader, &((ObjInstance*)object)->fields, -1);
+            break;
+        }
+        case OBJ_NATIVE:
+        {
+            NativeFn function = nativeAt((int)readU32(reader));
+            if (function == NULL) reader->failed = true;
+            else if (allocate) object = (Obj*)newNative(function);
+            break;
+        }
+        case OBJ_STRING:
+        {
+            uint32_t length = readU32(reader);
+            const uint8_t* chars = readBytes(reader, length);
+            if (allocate && chars != NULL && length <= INT32_MAX)
+            {
+                object = (Obj*)copyString((const char*)chars, (int)length);
+            }
+            break;
+        }
+        case OBJ_UPVALUE:
+        {
+            if (allocate)
+            {
+                ObjUpvalue* upvalue = newUpvalue(NULL);
+                upvalue->location = &upvalue->closed;
+                object = (Obj*)upvalue;
+            }
+            Value closed = readValue(loader);
+            if (link) ((ObjUpvalue*)object)->closed = closed;
+            break;
+        }
+        default:
+            reader->failed = true;
+    }
+
+    loader->objects[i] = object;
+}
+
+static char* readSnapshotFile(const char* path, size_t* size)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    long fileSize = ftell(file);
+    rewind(file);
+
+    char* buffer = fileSize < 0 ? NULL : (char*)malloc((size_t)fileSize + 1);
+    if (buffer != NULL && fread(buffer, 1, (size_t)fileSize, file) != (size_t)fileSize)
+    {
+        free(buffer);
+        buffer = NULL;
+    }
+
+    fclose(file);
+    *size = (size_t)fileSize;
+    return buffer;
+}
+
+/*
+ * Restores the modules that ran before the snapshot, so importing them
+ * again doesn't redo their initialization.
+ */
+static void readModules(Loader* loader)
+{
+    uint32_t count = readU32(&loader->reader);
+    for (uint32_t i = 0; i < count && !loader->reader.failed; i++)
+    {
+        ObjString* path = (ObjString*)readRef(loader, OBJ_STRING, false);
+        uint64_t hash = readU32(&loader->reader);
+        hash |= (uint64_t)readU32(&loader->reader) << 32;
+        if (!loader->reader.failed) addModule(path, hash);
+    }
+}
+
+/*
+ * Restores a heap written by writeSnapshot() into a freshly initialized
+ * vm. Collections are paused throughout, since the objects only become
+ * reachable once the globals are set at the very end.
+ */
+bool loadSnapshot(const char* path)
+{
+    size_t size;
+    char* buffer = readSnapshotFile(path, &size);
+    if (buffer == NULL) return false;
+
+    SnapshotHeader header;
+    Loader loader;
+    initReader(&loader.reader, buffer, size);
+    const uint8_t* bytes = readBytes(&loader.reader, sizeof(header));
+    if (bytes == NULL)
+    {
+        free(buffer);
+        return false;
+    }
+
+    memcpy(&header, bytes, sizeof(header));
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0
+        || header.version != SNAPSHOT_VERSION
+        || header.byteOrder != SNAPSHOT_BYTE_ORDER
+        || header.objectCount > size
+        || header.checksum != checksumBytes(CHECKSUM_START, loader.reader.pos, size - sizeof(header)))
+    {
+        free(buffer);
+        return false;
+    }
+
+    loader.objectCount = header.objectCount;
+    loader.objects = (Obj**)calloc(header.objectCount + 1, sizeof(Obj*));
+    if (loader.objects == NULL) exit(1);
+
+    vm.gcPaused = true;
+
+    const uint8_t* records = loader.reader.pos;
+    for (int pass = PASS_ALLOCATE; pass <= PASS_LINK; pass++)
+    {
+        loader.pass = (LoadPass)pass;
+        loader.reader.pos = records;
+        for (uint32_t i = 0; i < header.objectCount && !loader.reader.failed; i++)
+        {
+            readObject(&loader, i);
+            if (pass != PASS_ALLOCATE && loader.objects[i] == NULL) loader.reader.failed = true;
+        }
+        if (loader.reader.failed) break;
+    }
+
+    // Bytecode is checked once its constants are linked in.
+    for (uint32_t i = 0; i < header.objectCount && !loader.reader.failed; i++)
+    {
+        Obj* object = loader.objects[i];
+        if (object->type == OBJ_FUNCTION && !verifyCode((ObjFunction*)object)) loader.reader.failed = true;
+    }
+
+    // The roots go in last so a broken snapshot leaves the vm untouched,
+    // apart from some garbage.
+    if (!loader.reader.failed)
+    {
+        readTable(&loader, &vm.globals, -1);
+        vm.globalsDirty = true;
+        if (vm.gcPhase == GC_MARK) markTable(&vm.globals);
+        readModules(&loader);
+    }
+
+    vm.gcPaused = false;
+    free(loader.objects);
+    free(buffer);
+    return !loader.reader.failed;
+}
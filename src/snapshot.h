@@ -0,0 +1,9 @@
+#ifndef clox_snapshot_h
+#define clox_snapshot_h
+
+#include "common.h"
+
+bool writeSnapshot(const char* path);
+bool loadSnapshot(const char* path);
+
+#endif
@@ -1,55 +1,133 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+// At most 7 in 8 slots are used, deleted ones included.
+#define TABLE_MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
 
-static void adjustCapacity(Table* table, int capacity);
+// A key's hash picks the slot its probe starts at with the bits above
+// the 7 its tag is made of.
+#define HASH_START(hash) ((size_t)((hash) >> 7))
+#define HASH_TAG(hash) ((uint8_t)((hash) & 0x7f))
 
 void initTable(Table* table)
 {
     table->count = 0;
     table->capacity = 0;
-    table->entries = NULL;
+    table->control = NULL;
+}
+
+static size_t tableBytes(int capacity)
+{
+    return (sizeof(Value) + sizeof(ObjString*) + 1) * (size_t)capacity + TABLE_GROUP;
+}
+
+static size_t setBytes(int capacity)
+{
+    return (sizeof(ObjString*) + 1) * (size_t)capacity + TABLE_GROUP;
 }
 
 void freeTable(Table* table)
 {
-    FREE_ARRAY(Entry, table->entries, table->count);
+    if (table->capacity > 0) reallocate(tableValues(table), tableBytes(table->capacity), 0);
     initTable(table);
 }
 
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key)
+/*
+ * A bit for each slot of the group at 'control' whose control byte is
+ * 'tag', the first slot in the lowest bit.
+ */
+static inline uint32_t matchTag(const uint8_t* control, uint8_t tag)
 {
-    uint32_t index = key->hash % capacity;
-    Entry* tombstone = NULL;
-    while(1)
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i*)control);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+#else
+    uint32_t bits = 0;
+    for (int i = 0; i < TABLE_GROUP; i++)
     {
-        Entry* entry = entries + index;
-        if (entry->key == NULL)
-        {
-            if (IS_NIL(entry->value))
-            {
-               // Empty entry
-                return tombstone != NULL ? tombstone : entry;
-            }
-            else
-            {
-                // Tombstone found
-                if (tombstone == NULL) tombstone = entry;
-            }
-        }
-        else if (entry->key == key)
+        if (control[i] == tag) bits |= (uint32_t)1 << i;
+    }
+    return bits;
+#endif
+}
+
+/*
+ * Likewise for the slots not in use, whose control bytes are the ones with
+ * the top bit set.
+ */
+static inline uint32_t matchFree(const uint8_t* control)
+{
+#ifdef __SSE2__
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)control));
+#else
+    uint32_t bits = 0;
+    for (int i = 0; i < TABLE_GROUP; i++)
+    {
+        if (control[i] & TABLE_EMPTY) bits |= (uint32_t)1 << i;
+    }
+    return bits;
+#endif
+}
+
+/*
+ * Sets the control byte of 'slot', and its copy past the end if it has
+ * one, which lets a group that wraps around be loaded in one go.
+ */
+static void setControl(uint8_t* control, int capacity, size_t slot, uint8_t value)
+{
+    control[slot] = value;
+    if (slot < TABLE_GROUP) control[capacity + slot] = value;
+}
+
+// Probes go from group to group in steps one TABLE_GROUP longer each time,
+// which visits every slot once the capacity is a power of two of at least
+// TABLE_GROUP.
+#define FOR_EACH_GROUP(offset, start, capacity) \
+    for (size_t offset = (start) & ((size_t)(capacity) - 1), step_ = TABLE_GROUP; ; \
+         offset = (offset + step_) & ((size_t)(capacity) - 1), step_ += TABLE_GROUP)
+
+/*
+ * The slot 'key' is in, or -1 if it isn't there. Tables and string sets
+ * both keep their keys right in front of the control bytes, so this and
+ * the other probes below work for either.
+ */
+static inline int findSlot(const uint8_t* control, int capacity, ObjString* key)
+{
+    ObjString** keys = (ObjString**)control - capacity;
+    uint8_t tag = HASH_TAG(key->hash);
+    size_t mask = (size_t)capacity - 1;
+
+    FOR_EACH_GROUP(offset, HASH_START(key->hash), capacity)
+    {
+        const uint8_t* group = control + offset;
+        for (uint32_t bits = matchTag(group, tag); bits != 0; bits &= bits - 1)
         {
-            return entry;
+            size_t slot = (offset + __builtin_ctz(bits)) & mask;
+            if (keys[slot] == key) return (int)slot;
         }
+        if (matchTag(group, TABLE_EMPTY) != 0) return -1;
+    }
+}
 
-        index = (index + 1) % capacity;
+/*
+ * The first slot not in use on the probe for 'hash'. The load limit
+ * keeps some empty, so there always is one.
+ */
+static size_t findFree(const uint8_t* control, int capacity, uint32_t hash)
+{
+    FOR_EACH_GROUP(offset, HASH_START(hash), capacity)
+    {
+        uint32_t bits = matchFree(control + offset);
+        if (bits != 0) return (offset + __builtin_ctz(bits)) & ((size_t)capacity - 1);
     }
 }
 
@@ -57,124 +135,273 @@ bool tableGet(Table* table, ObjString* key, Value* value)
 {
     if (table->count == 0) return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int slot = findSlot(table->control, table->capacity, key);
+    if (slot < 0) return false;
 
-    *value = entry->value;
+    *value = tableValues(table)[slot];
     return true;
 }
 
-static void adjustCapacity(Table* table, int capacity)
+/*
+ * Moves the entries to 'capacity' new slots, leaving the deleted ones
+ * behind.
+ */
+static void resize(Table* table, int capacity)
 {
-    Entry* entries = ALLOCATE(Entry, capacity);
-    for (int i = 0; i < capacity; i++)
-    {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
-    }
+    uint8_t* block = (uint8_t*)reallocate(NULL, 0, tableBytes(capacity));
+    Value* values = (Value*)block;
+    ObjString** keys = (ObjString**)(values + capacity);
+    uint8_t* control = (uint8_t*)(keys + capacity);
+    memset(control, TABLE_EMPTY, (size_t)capacity + TABLE_GROUP);
 
-    table->count = 0;
+    int count = 0;
     for (int i = 0; i < table->capacity; i++)
     {
-        Entry* entry = table->entries + i;
-        if (entry->key == NULL) continue;
+        if (!tableSlotInUse(table, i)) continue;
 
-        Entry* dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+        ObjString* key = tableKeys(table)[i];
+        size_t slot = findFree(control, capacity, key->hash);
+        setControl(control, capacity, slot, HASH_TAG(key->hash));
+        keys[slot] = key;
+        values[slot] = tableValues(table)[i];
+        count++;
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-    table->entries = entries;
+    freeTable(table);
+    table->count = count;
     table->capacity = capacity;
+    table->control = control;
+}
+
+/*
+ * The capacity to rehash to once the load limit is hit: the same one if
+ * clearing out the deleted slots leaves it at most half full, twice as
+ * many otherwise.
+ */
+static int grownCapacity(const uint8_t* control, int capacity)
+{
+    if (capacity < TABLE_GROUP) return TABLE_GROUP;
+
+    int live = 0;
+    for (int i = 0; i < capacity; i++)
+    {
+        if (control[i] < TABLE_EMPTY) live++;
+    }
+    return (live + 1) * 2 > TABLE_MAX_LOAD(capacity) ? capacity * 2 : capacity;
 }
 
 bool tableSet(Table* table, ObjString* key, Value value)
 {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD)
+    if (table->count > 0)
     {
-        int capacity = NEW_ARRAY_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+        int slot = findSlot(table->control, table->capacity, key);
+        if (slot >= 0)
+        {
+            tableValues(table)[slot] = value;
+            return false;
+        }
     }
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
-    if (isNewKey && IS_NIL(entry->value))
+
+    if (table->count + 1 > TABLE_MAX_LOAD(table->capacity))
     {
-        // only increase count if entry was not a tombstone
-        // (tombstones count towards the load factor)
-        table->count++;
+        resize(table, grownCapacity(table->control, table->capacity));
     }
 
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+    size_t slot = findFree(table->control, table->capacity, key->hash);
+    if (table->control[slot] == TABLE_EMPTY) table->count++;
+
+    setControl(table->control, table->capacity, slot, HASH_TAG(key->hash));
+    tableKeys(table)[slot] = key;
+    tableValues(table)[slot] = value;
+    return true;
+}
+
+/*
+ * Marks 'slot' deleted. It still counts towards the load, as probes for
+ * other keys may have gone past it.
+ */
+static void deleteSlot(Table* table, size_t slot)
+{
+    setControl(table->control, table->capacity, slot, TABLE_DELETED);
+    tableKeys(table)[slot] = NULL;
+    tableValues(table)[slot] = NIL_VAL;
 }
 
 bool tableDelete(Table* table, ObjString* key)
 {
     if (table->count == 0) return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int slot = findSlot(table->control, table->capacity, key);
+    if (slot < 0) return false;
 
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    deleteSlot(table, (size_t)slot);
     return true;
 }
 
-void tableAddAll(Table* from, Table* to)
+/*
+ * Swaps 'key' for an object with the same hash, such as its copy after
+ * it moved, keeping its value. Only the replacement is looked at, since
+ * what's left of 'key' may have been overwritten by then.
+ */
+static void replaceKey(uint8_t* control, int capacity, ObjString* key, ObjString* replacement)
 {
-    for (int i = 0; i < from->capacity; i++)
+    if (capacity == 0) return;
+
+    ObjString** keys = (ObjString**)control - capacity;
+    uint8_t tag = HASH_TAG(replacement->hash);
+    size_t mask = (size_t)capacity - 1;
+
+    FOR_EACH_GROUP(offset, HASH_START(replacement->hash), capacity)
     {
-        Entry* entry = from->entries + i;
-        if (entry->key != NULL)
+        const uint8_t* group = control + offset;
+        for (uint32_t bits = matchTag(group, tag); bits != 0; bits &= bits - 1)
         {
-            tableSet(to, entry->key, entry->value);
+            size_t slot = (offset + __builtin_ctz(bits)) & mask;
+            if (keys[slot] == key)
+            {
+                keys[slot] = replacement;
+                return;
+            }
         }
+        if (matchTag(group, TABLE_EMPTY) != 0) return;
     }
 }
 
-ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash)
+void tableReplaceKey(Table* table, ObjString* key, ObjString* replacement)
 {
-    if (table->count == 0) return NULL;
+    replaceKey(table->control, table->capacity, key, replacement);
+}
 
-    uint32_t index = hash % table->capacity;
-    while(1)
+void tableAddAll(Table* from, Table* to)
+{
+    for (int i = 0; i < from->capacity; i++)
     {
-        Entry* entry = table->entries + index;
-        if (entry->key == NULL)
-        {
-            if (IS_NIL(entry->value)) return NULL;
-        }
-        else if (entry->key->length == length
-            && memcmp(entry->key->chars, chars, length) == 0)
-        {
-            return entry->key;
-        }
-
-        index = (index + 1) % table->capacity;
+        if (tableSlotInUse(from, i)) tableSet(to, tableKeys(from)[i], tableValues(from)[i]);
     }
 }
 
-void tableRemoveWhite(Table* table) 
+/*
+ * The key with the given characters. A tag match is wrong once in 128
+ * times, so the hash the key caches is checked before its characters.
+ */
+static ObjString* findString(const uint8_t* control, int capacity, const char* chars, int length, uint32_t hash)
 {
-    for (int i = 0; i < table->capacity; i++) 
+    if (capacity == 0) return NULL;
+
+    ObjString** keys = (ObjString**)control - capacity;
+    uint8_t tag = HASH_TAG(hash);
+    size_t mask = (size_t)capacity - 1;
+
+    FOR_EACH_GROUP(offset, HASH_START(hash), capacity)
     {
-        Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked) 
+        const uint8_t* group = control + offset;
+        for (uint32_t bits = matchTag(group, tag); bits != 0; bits &= bits - 1)
         {
-          tableDelete(table, entry->key);
+            ObjString* key = keys[(offset + __builtin_ctz(bits)) & mask];
+            if (key->hash == hash && key->length == length && memcmp(key->chars, chars, length) == 0) return key;
         }
+        if (matchTag(group, TABLE_EMPTY) != 0) return NULL;
     }
 }
 
+ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash)
+{
+    return findString(table->control, table->capacity, chars, length, hash);
+}
+
 void markTable(Table* table)
 {
+    // Free slots have nothing to mark.
     for (int i = 0; i < table->capacity; i++)
     {
-        Entry* entry = &table->entries[i];
-        markObject((Obj*)entry->key);
-        markValue(entry->value);
+        if (!tableSlotInUse(table, i)) continue;
+
+        markObject((Obj*)tableKeys(table)[i]);
+        markValue(tableValues(table)[i]);
+    }
+}
+
+void initStringSet(StringSet* set)
+{
+    set->count = 0;
+    set->capacity = 0;
+    set->control = NULL;
+}
+
+void freeStringSet(StringSet* set)
+{
+    if (set->capacity > 0) reallocate(stringSetKeys(set), setBytes(set->capacity), 0);
+    initStringSet(set);
+}
+
+ObjString* stringSetFind(StringSet* set, const char* chars, int length, uint32_t hash)
+{
+    return findString(set->control, set->capacity, chars, length, hash);
+}
+
+static void resizeSet(StringSet* set, int capacity)
+{
+    uint8_t* block = (uint8_t*)reallocate(NULL, 0, setBytes(capacity));
+    ObjString** keys = (ObjString**)block;
+    uint8_t* control = (uint8_t*)(keys + capacity);
+    memset(control, TABLE_EMPTY, (size_t)capacity + TABLE_GROUP);
+
+    int count = 0;
+    for (int i = 0; i < set->capacity; i++)
+    {
+        if (!stringSetSlotInUse(set, i)) continue;
+
+        ObjString* string = stringSetKeys(set)[i];
+        size_t slot = findFree(control, capacity, string->hash);
+        setControl(control, capacity, slot, HASH_TAG(string->hash));
+        keys[slot] = string;
+        count++;
+    }
+
+    freeStringSet(set);
+    set->count = count;
+    set->capacity = capacity;
+    set->control = control;
+}
+
+void stringSetAdd(StringSet* set, ObjString* string)
+{
+    if (set->count + 1 > TABLE_MAX_LOAD(set->capacity))
+    {
+        resizeSet(set, grownCapacity(set->control, set->capacity));
+    }
+
+    size_t slot = findFree(set->control, set->capacity, string->hash);
+    if (set->control[slot] == TABLE_EMPTY) set->count++;
+
+    setControl(set->control, set->capacity, slot, HASH_TAG(string->hash));
+    stringSetKeys(set)[slot] = string;
+}
+
+static void deleteString(StringSet* set, size_t slot)
+{
+    setControl(set->control, set->capacity, slot, TABLE_DELETED);
+    stringSetKeys(set)[slot] = NULL;
+}
+
+void stringSetDelete(StringSet* set, ObjString* string)
+{
+    if (set->capacity == 0) return;
+
+    int slot = findSlot(set->control, set->capacity, string);
+    if (slot >= 0) deleteString(set, (size_t)slot);
+}
+
+void stringSetReplace(StringSet* set, ObjString* string, ObjString* replacement)
+{
+    replaceKey(set->control, set->capacity, string, replacement);
+}
+
+void stringSetRemoveWhite(StringSet* set)
+{
+    ObjString** keys = stringSetKeys(set);
+    for (int i = 0; i < set->capacity; i++)
+    {
+        if (stringSetSlotInUse(set, i) && !isMarked((Obj*)keys[i])) deleteString(set, (size_t)i);
     }
 }
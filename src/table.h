@@ -4,27 +4,74 @@
 #include "common.h"
 #include "value.h"
 
-typedef struct
-{
-	ObjString* key;
-	Value value;
-} Entry;
+#define TABLE_GROUP 16				// Slots probed at once
 
+// Open addressing over a power-of-two number of slots, probed a group of
+// TABLE_GROUP at a time. Each slot has a control byte: the low 7 bits of
+// its key's hash, or TABLE_EMPTY or TABLE_DELETED, so a probe compares a
+// whole group of them before it looks at any key (see table.c). The keys
+// and values are kept in arrays of their own, in the same allocation as
+// the control bytes, right in front of them.
 typedef struct
 {
-	int count;
-	int capacity;
-	Entry* entries;
+	int count;						// Slots in use, deleted ones included
+	int capacity;					// Slots, a power of two, or 0 with nothing allocated
+	uint8_t* control;				// A byte per slot, then copies of the first TABLE_GROUP
 } Table;
 
+#define TABLE_EMPTY 0x80
+#define TABLE_DELETED 0xfe
+
+static inline bool tableSlotInUse(Table* table, int slot)
+{
+	return table->control[slot] < TABLE_EMPTY;
+}
+
+static inline ObjString** tableKeys(Table* table)
+{
+	return (ObjString**)table->control - table->capacity;
+}
+
+static inline Value* tableValues(Table* table)
+{
+	return (Value*)tableKeys(table) - table->capacity;
+}
+
 void initTable(Table* table);
 void freeTable(Table* table);
 bool tableGet(Table* table, ObjString* key, Value* value);
 bool tableSet(Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
+void tableReplaceKey(Table* table, ObjString* key, ObjString* replacement);
 void tableAddAll(Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
-void tableRemoveWhite(Table* table);
 void markTable(Table* table);
 
+// The interned strings, kept like the keys of a Table but without values.
+// A slot's control byte doubles as a fingerprint of its string's hash.
+typedef struct
+{
+	int count;						// Slots in use, deleted ones included
+	int capacity;					// Slots, a power of two, or 0 with nothing allocated
+	uint8_t* control;				// Laid out as in a Table, with the strings in front
+} StringSet;
+
+static inline bool stringSetSlotInUse(StringSet* set, int slot)
+{
+	return set->control[slot] < TABLE_EMPTY;
+}
+
+static inline ObjString** stringSetKeys(StringSet* set)
+{
+	return (ObjString**)set->control - set->capacity;
+}
+
+void initStringSet(StringSet* set);
+void freeStringSet(StringSet* set);
+ObjString* stringSetFind(StringSet* set, const char* chars, int length, uint32_t hash);
+void stringSetAdd(StringSet* set, ObjString* string);	// 'string' mustn't have an equal in the set yet
+void stringSetDelete(StringSet* set, ObjString* string);
+void stringSetReplace(StringSet* set, ObjString* string, ObjString* replacement);
+void stringSetRemoveWhite(StringSet* set);
+
 #endif
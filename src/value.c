@@ -25,6 +25,14 @@ void writeValueArray(ValueArray* array, Value value)
     array->count++;
 }
 
+void shrinkValueArray(ValueArray* array)
+{
+    if (array->capacity == array->count) return;
+
+    array->values = GROW_ARRAY(Value, array->values, array->capacity, array->count);
+    array->capacity = array->count;
+}
+
 void freeValueArray(ValueArray* array)
 {
     FREE_ARRAY(Value, array->values, array->capacity);
@@ -49,6 +49,7 @@ typedef struct
 bool valuesEqual(Value a, Value b);
 void initValueArray(ValueArray* array);
 void writeValueArray(ValueArray* array, Value value);
+void shrinkValueArray(ValueArray* array);
 void freeValueArray(ValueArray* array);
 void printValue(Value value);
 Value toBool(Value value);
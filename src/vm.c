@@ -1,6 +1,10 @@
+// For realpath(), which is X/Open and left out under -std=c11.
+#define _XOPEN_SOURCE 700
+
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
@@ -8,7 +12,11 @@
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "gcstats.h"
+#include "image.h"
+#include "marker.h"
 #include "memory.h"
+#include "module.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
@@ -21,6 +29,50 @@ static Value clockNative(int argCount, Value* args)
     return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
+/*
+ * gcStep(micros) lets a script hand the collector its idle time. Returns
+ * whether a collection is still in progress.
+ */
+static Value gcStepNative(int argCount, Value* args)
+{
+    double budget = argCount > 0 && IS_NUMBER(args[0]) ? AS_NUMBER(args[0]) : 0;
+    return BOOL_VAL(gcStep(budget));
+}
+
+/*
+ * gcCompact() has the heap compacted as soon as it returns.
+ */
+static Value gcCompactNative(int argCount, Value* args)
+{
+    requestCompaction();
+    return NIL_VAL;
+}
+
+/*
+ * gcStats() returns an instance with a field for each of the collector's
+ * counters (see gcstats.c).
+ */
+static Value gcStatsNative(int argCount, Value* args)
+{
+    return OBJ_VAL(newGcStatsInstance());
+}
+
+// Every native the vm defines. Snapshots refer to natives by their index
+// in here, so only ever append to it.
+static const struct
+{
+    const char* name;
+    NativeFn function;
+} natives[] =
+{
+    {"clock", clockNative},
+    {"gcStep", gcStepNative},
+    {"gcCompact", gcCompactNative},
+    {"gcStats", gcStatsNative},
+};
+
+#define NATIVE_COUNT ((int)(sizeof(natives) / sizeof(natives[0])))
+
 static void resetValueStack()
 {
     vm.valueStackTop = vm.valueStack;
@@ -41,7 +93,7 @@ static void runtimeError(const char* format, ...)
         CallFrame* frame = &vm.frames[i];
         ObjFunction* function = frame->closure->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+        fprintf(stderr, "[line %d] in ", getLine(&function->chunk, (int)instruction));
         if (function->name == NULL)
         {
             fprintf(stderr, "script\n");
@@ -54,11 +106,27 @@ static void runtimeError(const char* format, ...)
     resetValueStack();
 }
 
+/*
+ * The globals table has no object to remember, so the next minor
+ * collection is told to trace all of it instead. An incremental cycle
+ * only marks the globals when it starts, so later stores are shaded.
+ */
+static bool setGlobal(ObjString* name, Value value)
+{
+    if (name->obj.isYoung || isYoung(value)) vm.globalsDirty = true;
+    if (vm.gcPhase == GC_MARK)
+    {
+        markObject((Obj*)name);
+        markValue(value);
+    }
+    return tableSet(&vm.globals, name, value);
+}
+
 static void defineNative(const char* name, NativeFn function)
 {
     pushValue(OBJ_VAL(copyString(name, (int)strlen(name))));
     pushValue(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.valueStack[0]), vm.valueStack[1]);
+    setGlobal(AS_STRING(vm.valueStack[0]), vm.valueStack[1]);
     popValue();
     popValue();
 }
@@ -67,28 +135,105 @@ void initVM()
 {
     resetValueStack();
 
-    vm.objects = NULL;
     vm.bytesAllocated = 0;
-    vm.nextGC = 1024 * 1024;
-    vm.grayCount = 0;
+    vm.nextGC = GC_MIN_HEAP;
+    vm.pacer = (Pacer){0};
+    vm.pacer.overhead = 100;
+    vm.pacer.goal = GC_MIN_HEAP;
+    vm.pacer.cycleEnd = nowMicros();
+    setMemoryBudget(0, 0, NULL);
+    vm.outOfMemory = false;
     vm.grayCount = 0;
+    vm.grayCapacity = 0;
     vm.grayStack = NULL;
+    vm.remembered = NULL;
+    vm.rememberedCount = 0;
+    vm.rememberedCapacity = 0;
+    vm.globalsDirty = false;
+    vm.incrementalGC = false;
+    vm.gcPhase = GC_IDLE;
+    vm.gcDebt = 0;
+    vm.markThreads = defaultMarkThreads();
+    for (int i = 0; i < POOL_CLASS_COUNT; i++)
+    {
+        vm.sweepCursors[i] = NULL;
+    }
+    vm.compactGC = false;
+    vm.compactPending = false;
+    vm.gcStats = (GcStats){0};
+    vm.images = NULL;
+    vm.modules = NULL;
+    vm.moduleCount = 0;
+    vm.moduleCapacity = 0;
+    vm.useImageCache = false;
+    vm.lazyCompile = false;
+    vm.gcPaused = false;
+    initPool(&vm.pool);
+    initNursery();
 
     initTable(&vm.globals);
-    initTable(&vm.strings);
+    initStringSet(&vm.strings);
 
     vm.initString = NULL;
     vm.initString = copyString("init", 4);
 
-    defineNative("clock", clockNative);
+    for (int i = 0; i < NATIVE_COUNT; i++)
+    {
+        defineNative(natives[i].name, natives[i].function);
+    }
 }
 
 void freeVM()
 {
     freeTable(&vm.globals);
-    freeTable(&vm.strings);
+    freeStringSet(&vm.strings);
     vm.initString = NULL;
+    for (int i = 0; i < vm.moduleCount; i++)
+    {
+        free(vm.modules[i].source);
+    }
+    FREE_ARRAY(Module, vm.modules, vm.moduleCapacity);
     freeObjects();
+    freeImages();
+}
+
+/*
+ * Registers a module that ran in this vm. A module whose source changed
+ * gets a new entry rather than replacing the old one, since functions of
+ * the old version may still need their source to compile lazily.
+ */
+Module* addModule(ObjString* path, uint64_t hash)
+{
+    if (vm.moduleCapacity < vm.moduleCount + 1)
+    {
+        pushValue(OBJ_VAL(path));
+        int oldCapacity = vm.moduleCapacity;
+        vm.moduleCapacity = NEW_ARRAY_CAPACITY(oldCapacity);
+        vm.modules = GROW_ARRAY(Module, vm.modules, oldCapacity, vm.moduleCapacity);
+        popValue();
+    }
+
+    Module* module = &vm.modules[vm.moduleCount++];
+    module->path = path;
+    module->hash = hash;
+    module->source = NULL;
+    module->function = NULL;
+    return module;
+}
+
+int nativeIndex(NativeFn function)
+{
+    for (int i = 0; i < NATIVE_COUNT; i++)
+    {
+        if (natives[i].function == function) return i;
+    }
+    return -1;
+}
+
+NativeFn nativeAt(int index)
+{
+    if (index < 0 || index >= NATIVE_COUNT) return NULL;
+    return natives[index].function;
 }
 
 void pushValue(Value value)
@@ -122,6 +267,20 @@ static bool call(ObjClosure* closure, int argCount)
         return false;
     }
 
+    if (closure->function->lazyBody != NULL && !compileLazyBody(closure->function))
+    {
+        runtimeError("Could not compile function body.");
+        return false;
+    }
+
+    // Functions can have more locals than a handful of frames would ever
+    // leave room for, so check the whole frame fits before entering it.
+    if (vm.valueStackTop - vm.valueStack - argCount - 1 + closure->function->stackSlots > VALUE_STACK_MAX)
+    {
+        runtimeError("Stack overflow.");
+        return false;
+    }
+
     CallFrame* frame = &vm.frames[vm.frameCount++];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
@@ -260,6 +419,7 @@ static void closeUpvalues(Value* last)
         ObjUpvalue* upvalue = vm.openUpvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        writeBarrier((Obj*)upvalue, upvalue->closed);
         vm.openUpvalues = upvalue->next;
     }
 }
@@ -269,6 +429,8 @@ static void defineMethod(ObjString* name)
     Value method = peek(0);
     ObjClass* klass = AS_CLASS(peek(1));
     tableSet(&klass->methods, name, method);
+    writeBarrier((Obj*)klass, OBJ_VAL(name));
+    writeBarrier((Obj*)klass, method);
     popValue();
 }
 
@@ -277,18 +439,108 @@ static void concatenate()
     ObjString* b = AS_STRING(peek(0));
     ObjString* a = AS_STRING(peek(1));
 
-    int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
-
-    ObjString* result = takeString(chars, length);
+    // Built in place, as allocating doesn't move 'a' or 'b'.
+    ObjString* result = newString(a->length + b->length);
+    memcpy(result->chars, a->chars, a->length);
+    memcpy(result->chars + a->length, b->chars, b->length);
+    result = finishString(result);
     popValue();
     popValue();
     pushValue(OBJ_VAL(result));
 }
 
+static bool callScript(ObjFunction* function)
+{
+    pushValue(OBJ_VAL(function));
+    ObjClosure* closure = newClosure(function);
+    popValue();
+    pushValue(OBJ_VAL(closure));
+    return call(closure, 0);
+}
+
+static int findModule(ObjString* path)
+{
+    for (int i = vm.moduleCount - 1; i >= 0; i--)
+    {
+        // paths are interned, so comparing pointers is enough
+        if (vm.modules[i].path == path) return i;
+    }
+    return -1;
+}
+
+/*
+ * Registers a module compiled ahead of its first import, unless this
+ * version of it already ran.
+ */
+void addCompiledModule(const char* path, uint64_t hash, ObjFunction* function)
+{
+    pushValue(OBJ_VAL(function));
+    ObjString* modulePath = copyString(path, (int)strlen(path));
+    int module = findModule(modulePath);
+    if (module == -1 || vm.modules[module].hash != hash)
+    {
+        addModule(modulePath, hash)->function = function;
+    }
+    popValue();
+}
+
+/*
+ * Runs the module at 'name' unless this version of it already ran in the
+ * vm, in which case the globals it defined are still around. Either way
+ * leaves a value on the stack for the import statement to pop.
+ */
+static bool importModule(ObjString* name)
+{
+    char* fullPath = realpath(name->chars, NULL);
+    char* source = fullPath != NULL ? readSource(fullPath) : NULL;
+    if (source == NULL)
+    {
+        free(fullPath);
+        runtimeError("Could not read module '%s'.", name->chars);
+        return false;
+    }
+
+    ObjString* path = copyString(fullPath, (int)strlen(fullPath));
+    uint64_t hash = hashSource(source);
+    free(fullPath);
+
+    int module = findModule(path);
+    if (module != -1 && vm.modules[module].hash == hash)
+    {
+        free(source);
+
+        ObjFunction* function = vm.modules[module].function;
+        if (function == NULL)
+        {
+            pushValue(NIL_VAL);
+            return true;
+        }
+
+        // Compiled ahead of time and now it runs.
+        vm.modules[module].function = NULL;
+        return callScript(function);
+    }
+
+    pushValue(OBJ_VAL(path));
+    ObjFunction* function = compileCached(path->chars, source);
+    if (function != NULL)
+    {
+        // Registered before it runs, so import cycles end here.
+        pushValue(OBJ_VAL(function));
+        addModule(path, hash)->source = vm.lazyCompile ? source : NULL;
+        popValue();
+    }
+    popValue();
+
+    if (!vm.lazyCompile || function == NULL) free(source);
+    if (function == NULL)
+    {
+        runtimeError("Could not compile module '%s'.", name->chars);
+        return false;
+    }
+    return callScript(function);
+}
+
 static bool isFalsey(Value value)
 {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
@@ -298,10 +550,19 @@ static InterpretResult run()
 {
     CallFrame* frame = &vm.frames[vm.frameCount - 1];
 
+    uint8_t instruction;
+
 #define READ_BYTE() (*frame->ip++)
 #define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_UINT24() (frame->ip += 3, \
+        (uint32_t)((frame->ip[-3] << 16) | (frame->ip[-2] << 8) | frame->ip[-1]))
+#define READ_UINT32() (frame->ip += 4, \
+        ((uint32_t)frame->ip[-4] << 24) | (uint32_t)((frame->ip[-3] << 16) | (frame->ip[-2] << 8) | frame->ip[-1]))
+// Each instruction that takes a constant shares its case with its _LONG
+// form, which is named so the operand width can be told apart.
+#define READ_CONSTANT(longOp) (frame->closure->function->chunk.constants.values[ \
+        instruction == (longOp) ? READ_UINT24() : READ_BYTE()])
+#define READ_STRING(longOp) AS_STRING(READ_CONSTANT(longOp))
 #define BINARY_OP(valueType, op) \
     do { \
         if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
@@ -312,9 +573,32 @@ static InterpretResult run()
         double a = AS_NUMBER(popValue()); \
         pushValue(valueType(a op b)); \
     } while (false)
+#define COMPARE_JUMP(op, jumpIf) \
+    do { \
+        uint16_t offset = READ_SHORT(); \
+        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+            runtimeError("Operands must be numbers."); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+        double b = AS_NUMBER(popValue()); \
+        double a = AS_NUMBER(popValue()); \
+        if ((a op b) == jumpIf) frame->ip += offset; \
+    } while (false)
 
     while(1)
     {
+        // Between instructions nothing but the vm's own roots refers to
+        // a young object, so this is where they can move. It's also where
+        // a script that ran out of memory can be stopped cleanly.
+        if (vm.nurseryFull)
+        {
+            collectNursery();
+            if (memoryExhausted())
+            {
+                runtimeError("Out of memory.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+        }
 
 #ifdef DEBUG_TRACE_EXECUTION
     printf("           ");
@@ -331,7 +615,7 @@ static InterpretResult run()
             );
 #endif
 
-        switch (READ_BYTE())
+        switch (instruction = READ_BYTE())
         {
             case OP_ADD:
                 if (IS_STRING(peek(0)) && IS_STRING(peek(1))) 
@@ -361,21 +645,23 @@ static InterpretResult run()
                 break;
             }
             case OP_CLASS:
-                pushValue(OBJ_VAL(newClass(READ_STRING())));
+            case OP_CLASS_LONG:
+                pushValue(OBJ_VAL(newClass(READ_STRING(OP_CLASS_LONG))));
                 break;
             case OP_CLOSE_UPVALUE:
                 closeUpvalues(vm.valueStackTop - 1);
                 popValue();
                 break;
             case OP_CLOSURE:
+            case OP_CLOSURE_LONG:
             {
-                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+                ObjFunction* function = AS_FUNCTION(READ_CONSTANT(OP_CLOSURE_LONG));
                 ObjClosure* closure = newClosure(function);
                 pushValue(OBJ_VAL(closure));
                 for (int i = 0; i < closure->upvalueCount; i++)
                 {
                     uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
+                    uint16_t index = READ_SHORT();
                     if (isLocal)
                     {
                         closure->upvalues[i] = captureUpvalue(frame->slots + index);
@@ -384,14 +670,17 @@ static InterpretResult run()
                     {
                         closure->upvalues[i] = frame->closure->upvalues[index];    
                     }
+                    writeBarrier((Obj*)closure, OBJ_VAL(closure->upvalues[i]));
                 }
                 break;
             }
             case OP_CONSTANT:
-                pushValue(READ_CONSTANT());
+            case OP_CONSTANT_LONG:
+                pushValue(READ_CONSTANT(OP_CONSTANT_LONG));
                 break;
             case OP_DEFINE_GLOBAL:
-                tableSet(&vm.globals, READ_STRING(), peek(0));
+            case OP_DEFINE_GLOBAL_LONG:
+                setGlobal(READ_STRING(OP_DEFINE_GLOBAL_LONG), peek(0));
                 popValue();
                 break;
             case OP_DIVIDE:
@@ -404,8 +693,9 @@ static InterpretResult run()
                 pushValue(BOOL_VAL(false));
                 break;
             case OP_GET_GLOBAL:
+            case OP_GET_GLOBAL_LONG:
             {
-                ObjString* name = READ_STRING();
+                ObjString* name = READ_STRING(OP_GET_GLOBAL_LONG);
                 Value value;
                 if (!tableGet(&vm.globals, name, &value))
                 {
@@ -416,12 +706,14 @@ static InterpretResult run()
                 break;
             }
             case OP_GET_LOCAL:
+            case OP_GET_LOCAL_LONG:
             {
-                uint8_t slot = READ_BYTE();
+                uint16_t slot = instruction == OP_GET_LOCAL_LONG ? READ_SHORT() : READ_BYTE();
                 pushValue(frame->slots[slot]);
                 break;
             }
             case OP_GET_PROPERTY:
+            case OP_GET_PROPERTY_LONG:
             {
                 if (!IS_INSTANCE(peek(0))) {
                     runtimeError("Only instances have properties.");
@@ -429,7 +721,7 @@ static InterpretResult run()
                 }
 
                 ObjInstance* instance = AS_INSTANCE(peek(0));
-                ObjString* name = READ_STRING();
+                ObjString* name = READ_STRING(OP_GET_PROPERTY_LONG);
 
                 Value value;
                 if (tableGet(&instance->fields, name, &value)) 
@@ -446,8 +738,9 @@ static InterpretResult run()
                 break;
             }
             case OP_GET_SUPER:
+            case OP_GET_SUPER_LONG:
             {
-                ObjString* name = READ_STRING();
+                ObjString* name = READ_STRING(OP_GET_SUPER_LONG);
                 ObjClass* superclass = AS_CLASS(popValue());
                 if (!bindMethod(superclass, name))
                 {
@@ -464,6 +757,14 @@ static InterpretResult run()
             case OP_GREATER:
                 BINARY_OP(BOOL_VAL, >); 
                 break;
+            case OP_IMPORT:
+            case OP_IMPORT_LONG:
+                if (!importModule(READ_STRING(OP_IMPORT_LONG)))
+                {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                frame = &vm.frames[vm.frameCount - 1];
+                break;
             case OP_INHERIT:
             {
                 Value superclass = peek(1);
@@ -474,11 +775,14 @@ static InterpretResult run()
                 }
                 ObjClass* subclass = AS_CLASS(peek(0));
                 tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+                writeBarrierTable((Obj*)subclass, &subclass->methods);
                 popValue(); // pop the subclass
                 break;
             }
-            case OP_INVOKE: {
-                ObjString* method = READ_STRING();
+            case OP_INVOKE:
+            case OP_INVOKE_LONG:
+            {
+                ObjString* method = READ_STRING(OP_INVOKE_LONG);
                 int argCount = READ_BYTE();
                 if (!invoke(method, argCount))
                 {
@@ -488,28 +792,55 @@ static InterpretResult run()
                 break;
             }
             case OP_JUMP:
+            case OP_JUMP_LONG:
             {
-                uint16_t offset = READ_SHORT();
+                uint32_t offset = instruction == OP_JUMP_LONG ? READ_UINT32() : READ_SHORT();
                 frame->ip += offset;
                 break;
             }
+            case OP_JUMP_IF_EQUAL:
+            {
+                uint16_t offset = READ_SHORT();
+                if (valuesEqual(popValue(), popValue())) frame->ip += offset;
+                break;
+            }
             case OP_JUMP_IF_FALSE:
             {
                 uint16_t offset = READ_SHORT();
                 if (isFalsey(peek(0))) frame->ip += offset;
                 break;
             }
+            case OP_JUMP_IF_GREATER:
+                COMPARE_JUMP(>, true);
+                break;
+            case OP_JUMP_IF_LESS:
+                COMPARE_JUMP(<, true);
+                break;
+            case OP_JUMP_IF_NOT_EQUAL:
+            {
+                uint16_t offset = READ_SHORT();
+                if (!valuesEqual(popValue(), popValue())) frame->ip += offset;
+                break;
+            }
+            case OP_JUMP_IF_NOT_GREATER:
+                COMPARE_JUMP(>, false);
+                break;
+            case OP_JUMP_IF_NOT_LESS:
+                COMPARE_JUMP(<, false);
+                break;
             case OP_LESS:
                 BINARY_OP(BOOL_VAL, <); 
                 break;
             case OP_LOOP:
+            case OP_LOOP_LONG:
             {
-                uint16_t offset = READ_SHORT();
+                uint32_t offset = instruction == OP_LOOP_LONG ? READ_UINT32() : READ_SHORT();
                 frame->ip -= offset;
                 break;
             }
             case OP_METHOD:
-                defineMethod(READ_STRING());
+            case OP_METHOD_LONG:
+                defineMethod(READ_STRING(OP_METHOD_LONG));
                 break;
             case OP_MULTIPLY:
                 BINARY_OP(NUMBER_VAL, *);
@@ -552,9 +883,10 @@ static InterpretResult run()
                 break;
             }
             case OP_SET_GLOBAL:
+            case OP_SET_GLOBAL_LONG:
             {
-                ObjString* name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0)))
+                ObjString* name = READ_STRING(OP_SET_GLOBAL_LONG);
+                if (setGlobal(name, peek(0)))
                 {
                     // If tableSet() returns true, the given key did not exist yet.
                     // As lox doesn't allow implicit var decl, this is a runtime error.
@@ -565,12 +897,14 @@ static InterpretResult run()
                 break;
             }
             case OP_SET_LOCAL:
+            case OP_SET_LOCAL_LONG:
             {
-                uint8_t slot = READ_BYTE();
+                uint16_t slot = instruction == OP_SET_LOCAL_LONG ? READ_SHORT() : READ_BYTE();
                 frame->slots[slot] = peek(0);
                 break;
             }
             case OP_SET_PROPERTY:
+            case OP_SET_PROPERTY_LONG:
             {
                 if (!IS_INSTANCE(peek(1)))
                 {
@@ -579,7 +913,10 @@ static InterpretResult run()
                 }
 
                 ObjInstance* instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
+                ObjString* name = READ_STRING(OP_SET_PROPERTY_LONG);
+                tableSet(&instance->fields, name, peek(0));
+                writeBarrier((Obj*)instance, OBJ_VAL(name));
+                writeBarrier((Obj*)instance, peek(0));
                 Value value = popValue();
                 popValue();
                 pushValue(value);
@@ -587,16 +924,18 @@ static InterpretResult run()
             }
             case OP_SET_UPVALUE:
             {
-                uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
+                ObjUpvalue* upvalue = frame->closure->upvalues[READ_BYTE()];
+                *upvalue->location = peek(0);
+                writeBarrier((Obj*)upvalue, peek(0));
                 break;
             }
             case OP_SUBTRACT:
                 BINARY_OP(NUMBER_VAL, -);
                 break;
             case OP_SUPER_INVOKE:
+            case OP_SUPER_INVOKE_LONG:
             {
-                ObjString* method = READ_STRING();
+                ObjString* method = READ_STRING(OP_SUPER_INVOKE_LONG);
                 int argCount = READ_BYTE();
                 ObjClass* superclass = AS_CLASS(popValue());
                 if (!invokeFromClass(superclass, method, argCount))
@@ -614,21 +953,46 @@ static InterpretResult run()
 
 #undef READ_BYTE
 #undef READ_SHORT
+#undef READ_UINT24
+#undef READ_UINT32
 #undef READ_CONSTANT
 #undef READ_STRING
 #undef BINARY_OP
+#undef COMPARE_JUMP
 }
 
-InterpretResult interpret(const char* source)
+static InterpretResult runScript(ObjFunction* function)
 {
-    ObjFunction* function = compile(source);
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
-    pushValue(OBJ_VAL(function));
-    ObjClosure* closure = newClosure(function);
-    popValue();
-    pushValue(OBJ_VAL(closure));
-    call(closure, 0);
-
+    callScript(function);
     return run();
 }
+
+InterpretResult interpret(const char* source)
+{
+    return runScript(compile(source, NULL));
+}
+
+/*
+ * Runs the script at 'path', whose contents the caller keeps alive until
+ * the vm is freed. The script counts as a module, so importing it again
+ * won't rerun it, and its imports are resolved relative to it.
+ */
+InterpretResult interpretFile(const char* path, const char* source)
+{
+    char* fullPath = realpath(path, NULL);
+    const char* chars = fullPath != NULL ? fullPath : path;
+    ObjString* modulePath = copyString(chars, (int)strlen(chars));
+    free(fullPath);
+
+    addModule(modulePath, hashSource(source));
+
+    startPrecompile(modulePath->chars, source);
+    ObjFunction* function = compileCached(modulePath->chars, source);
+    if (function != NULL) pushValue(OBJ_VAL(function));
+    finishPrecompile();
+    if (function != NULL) popValue();
+
+    return runScript(function);
+}
@@ -2,7 +2,9 @@
 #define clox_vm_h
 
 #include "chunk.h"
+#include "gcstats.h"
 #include "object.h"
+#include "pool.h"
 #include "table.h"
 #include "value.h"
 
@@ -16,6 +18,50 @@ typedef struct
 	Value* slots;
 } CallFrame;
 
+typedef struct
+{
+	ObjString* path;					// Canonical path of the module's source file
+	uint64_t hash;						// Hash of the source it was compiled from
+	char* source;						// Kept for lazily compiled bodies, NULL otherwise
+	ObjFunction* function;				// Compiled ahead of its import, NULL once it ran
+} Module;
+
+// An incremental collection marks and then sweeps in slices, with the
+// program running in between.
+typedef enum
+{
+	GC_IDLE,
+	GC_MARK,
+	GC_SWEEP,
+} GcPhase;
+
+// After each cycle, the pacer sets the heap size the next one should be
+// done by, and when it has to start for that.
+typedef struct
+{
+	int overhead;						// Percent the heap may grow past what's live
+	size_t limit;						// Heap size not to go past, 0 for none
+	size_t goal;						// Heap size the next cycle should be done by
+	double allocationRate;				// Bytes the program allocates per microsecond
+	double markMicros;					// Collector time the last mark took
+	size_t markAllocated;				// Bytes allocated while it marked
+	double gcAtMarkStart;				// gcMicros() when it started
+	size_t allocatedAtMarkStart;		// gcStats.bytesAllocated likewise
+	double cycleEnd;					// nowMicros() when the last cycle ended
+	double gcAtCycleEnd;				// gcMicros() likewise
+} Pacer;
+
+// A host can cap the memory of a vm (see setMemoryBudget()). Past the soft
+// limit it collects everything at once and tells the host; past the hard
+// limit, the script fails with a runtime error.
+typedef struct
+{
+	size_t soft;						// SIZE_MAX for none
+	size_t hard;						// Likewise
+	void (*onSoftLimit)(size_t bytesInUse);	// Called each time the heap crosses the soft limit
+	bool overSoft;						// Crossed it since a cycle last left the heap below it
+} MemoryBudget;
+
 typedef struct
 {
 	CallFrame frames[FRAMES_MAX];		// Stackframes
@@ -23,16 +69,43 @@ typedef struct
 	Value valueStack[VALUE_STACK_MAX];
 	Value* valueStackTop;				// First empty slot of value stack
 	Table globals;						// global variables
-	Table strings;						// Interned strings
+	StringSet strings;					// Interned strings
 	ObjString* initString;				
+	Module* modules;					// Modules imported so far, newest version last
+	int moduleCount;
+	int moduleCapacity;
 	ObjUpvalue* openUpvalues;			// Closed over variables still on stack
 	size_t bytesAllocated;
-	size_t nextGC;
-	struct Obj* objects;				// Linked list of objects allocated on heap
+	size_t nextGC;						// Heap size that starts the next cycle
+	Pacer pacer;						// What decides nextGC
+	MemoryBudget budget;
+	bool outOfMemory;					// An allocation went past the hard limit
+	Pool pool;							// Every old object, by size class
 	// "gray" means processed, but not all children processed
 	int grayCount;						// Count of gray objects
 	int grayCapacity;					// Max nr of gray objects
 	Obj** grayStack;					// List of references to gray objects
+	uint8_t* nursery;					// Young generation, bump allocated (see memory.c)
+	uint8_t* nurseryTop;				// First free byte of the nursery
+	uint8_t* nurseryEnd;
+	uint64_t* nurseryMarks;				// Mark bits of the young objects
+	bool nurseryFull;					// Run a minor collection at the next safepoint
+	Obj** remembered;					// Old objects that may point into the nursery
+	int rememberedCount;
+	int rememberedCapacity;
+	bool globalsDirty;					// Globals may point into the nursery
+	bool incrementalGC;					// Collect in slices instead of all at once
+	GcPhase gcPhase;					// Where the collection in progress is
+	size_t gcDebt;						// Bytes allocated since the last slice
+	int markThreads;					// Threads marking the heap at once
+	PoolPage* sweepCursors[POOL_CLASS_COUNT];	// Next page of each size class the sweep looks at
+	bool compactGC;						// Compact the heap once it's fragmented enough
+	bool compactPending;				// Compact at the next safepoint
+	GcStats gcStats;					// What the collector did so far
+	struct Image* images;				// Bytecode images mapped in by the loader
+	bool useImageCache;					// Load and write bytecode images next to scripts
+	bool lazyCompile;					// Compile function bodies on their first call
+	bool gcPaused;						// Defer collections while objects aren't rooted yet
 } VM;
 
 typedef enum
@@ -47,6 +120,11 @@ extern VM vm;
 void initVM();
 void freeVM();
 InterpretResult interpret(const char* source);
+InterpretResult interpretFile(const char* path, const char* source);
+Module* addModule(ObjString* path, uint64_t hash);
+void addCompiledModule(const char* path, uint64_t hash, ObjFunction* function);
+int nativeIndex(NativeFn function);
+NativeFn nativeAt(int index);
 void pushValue(Value value);
 Value popValue();
 